@@ -0,0 +1,53 @@
+#! /bin/bash
+
+# Usage: ./bench-pzip.sh [gigabytes] [max threads]
+#
+# Builds a short-run input of the given size (2 GB by default, made of
+# copies of a 256 MB piece from wzip's tests/filegen.py), then times pzip
+# on it with 1, 2, 4, ... threads up to the number of CPUs, printing the
+# best of three runs and the speedup over one thread. The output is
+# checked against wzip's first, if wzip has been built.
+
+size=${1:-2}
+max=${2:-$(nproc)}
+wzip=../initial-utilities/wzip/wzip
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+if ! [[ -x pzip ]]; then
+    echo "pzip executable does not exist"
+    exit 1
+fi
+
+python3 ../initial-utilities/wzip/tests/filegen.py runs 256 > $dir/piece
+for ((i = 0; i < size * 4; i++)); do
+    cat $dir/piece
+done > $dir/in
+rm $dir/piece
+bytes=$(stat -c %s $dir/in)
+
+if [[ -x $wzip ]]; then
+    ./pzip $dir/in > $dir/out
+    $wzip $dir/in | cmp -s - $dir/out || { echo "pzip output differs from wzip"; exit 1; }
+fi
+
+threads=1
+base=
+while ((threads <= max)); do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s.%N)
+        PZIP_THREADS=$threads ./pzip $dir/in > $dir/out
+        end=$(date +%s.%N)
+        best=$(awk -v s=$start -v e=$end -v b="$best" 'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+    done
+    base=${base:-$best}
+    printf "%3d threads  %6d MB  %7.3f s  %6.2f GB/s  %5.2fx\n" $threads $((bytes >> 20)) $best \
+           $(awk -v n=$bytes -v t=$best 'BEGIN { print n / t / 1e9 }') \
+           $(awk -v b=$base -v t=$best 'BEGIN { print b / t }')
+    if ((threads < max && threads * 2 > max)); then
+        threads=$max
+    else
+        threads=$((threads * 2))
+    fi
+done
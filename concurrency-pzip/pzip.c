@@ -0,0 +1,481 @@
+//
+// pzip: parallel version of wzip, with byte-for-byte the same output.
+//
+// All input files are mapped up front and cut into fixed-size chunks,
+// which a pool of worker threads (one per CPU) compresses independently,
+// each into its own buffer of 5-byte records. Idle workers take the next
+// chunk, so fast threads end up doing more of the work. The main thread
+// writes the chunks out in order, merging the last run of one chunk with
+// the first run of the next when they are the same byte (runs cross chunk
+// and file boundaries just like in wzip).
+//
+// To compile: gcc -Wall -Werror -pthread -O -o pzip pzip.c
+//
+// With -b blocksize, pzip writes wzip's framed format instead (see
+// wunzip.c): every chunk becomes a block of its own, so there is nothing to
+// stitch, and the index is written at the end.
+//
+// PZIP_THREADS and PZIP_CHUNK (in bytes) override the number of workers
+// and the chunk size, for benchmarks and tests.
+//
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define DEFAULT_CHUNK (4 * 1024 * 1024)
+// Chunks that may be compressed ahead of the writer, per worker; bounds
+// how much compressed output sits in memory.
+#define CHUNKS_AHEAD 4
+#define RECORD_SIZE 5
+#define OUT_BUFFER (64 * 1024)
+
+#define FRAME_MAGIC "\0\0\0\0WZF1"
+#define INDEX_MAGIC "WZFINDEX"
+#define MAGIC_SIZE 8
+
+typedef struct Input {
+    char const *data;
+    size_t len;
+    bool mapped;            // else malloc'ed (pipes)
+} input_t;
+
+typedef struct Chunk {
+    char const *data;
+    size_t len;
+    char *out;              // records for this chunk alone
+    size_t out_len;
+    bool done;
+} chunk_t;
+
+typedef struct Pool {
+    chunk_t *chunks;
+    size_t nchunks;
+    size_t next;            // next chunk to hand to a worker
+    size_t written;         // chunks the writer is done with
+    size_t ahead;           // how far 'next' may run ahead of 'written'
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // a chunk became available to workers
+    pthread_cond_t done;    // a chunk finished compressing
+} pool_t;
+
+typedef struct Writer {
+    char buffer[OUT_BUFFER];
+    size_t len;
+    char c;                 // the run not written yet, since the next
+    uint64_t count;         // chunk may extend it; count 0 if none
+    bool failed;
+    uint64_t written;       // bytes handed to writev() so far
+
+    // Framed format only.
+    uint64_t raw;           // input bytes in the blocks so far
+    uint64_t *index;        // per block: input offset, then output offset
+    size_t nblocks;
+} writer_t;
+
+//
+// Finding where a run ends; same kernels as wzip. Each returns the first
+// byte in [p, end) that differs from 'c', or 'end'.
+//
+typedef char const *(*run_end_fn)(char const *p, char const *end, char c);
+
+static char const *run_end_scalar(char const *p, char const *end, char c) {
+    while (p < end && *p == c) {
+        ++p;
+    }
+    return p;
+}
+
+#if defined(__x86_64__)
+static char const *run_end_sse2(char const *p, char const *end, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((__m128i const *)p);
+        unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)) & 0xffff;
+        if (differ != 0) {
+            return p + __builtin_ctz(differ);
+        }
+        p += 16;
+    }
+    return run_end_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static char const *run_end_avx2(char const *p, char const *end, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((__m256i const *)p);
+        unsigned differ = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (differ != 0) {
+            return p + __builtin_ctz(differ);
+        }
+        p += 32;
+    }
+    return run_end_sse2(p, end, c);
+}
+#endif
+
+static run_end_fn run_end = run_end_scalar;
+
+// Chunks are at most INT_MAX bytes, so every run inside one fits in a
+// single record.
+static void compress_chunk(chunk_t *chunk) {
+    char const *p = chunk->data;
+    char const *end = p + chunk->len;
+    // Worst case is one record per input byte; only the pages actually
+    // written get backed by memory.
+    chunk->out = (char *)malloc(chunk->len * RECORD_SIZE);
+    if (chunk->out == NULL) {
+        fprintf(stderr, "pzip: out of memory\n");
+        exit(1);
+    }
+    char *out = chunk->out;
+
+    while (p < end) {
+        char const *q = p + 1;
+        if (q < end && *q == *p) {
+            q = run_end(q, end, *p);
+        }
+        int count = q - p;
+        memcpy(out, &count, sizeof(count));
+        out[4] = *p;
+        out += RECORD_SIZE;
+        p = q;
+    }
+    chunk->out_len = out - chunk->out;
+}
+
+static void *worker(void *arg) {
+    pool_t *pool = (pool_t *)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->nchunks && pool->next >= pool->written + pool->ahead) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->next == pool->nchunks) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        chunk_t *chunk = &pool->chunks[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        compress_chunk(chunk);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = true;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+//
+// Output.
+//
+static void write_all(writer_t *w, struct iovec *iov, int iovcnt) {
+    ssize_t n = 0;
+    while (iovcnt > 0 && !w->failed) {
+        // Also steps over empty pieces, which writev() would report as
+        // nothing written.
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt == 0) {
+            break;
+        }
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+        n = writev(STDOUT_FILENO, iov, iovcnt);
+        if (n <= 0) {
+            w->failed = true;
+        } else {
+            w->written += n;
+        }
+    }
+}
+
+static void flush_output(writer_t *w) {
+    struct iovec iov = { w->buffer, w->len };
+    write_all(w, &iov, 1);
+    w->len = 0;
+}
+
+// Same splitting as wzip: runs longer than INT_MAX become several records.
+static void emit_run(writer_t *w, char c, uint64_t count) {
+    while (count > 0) {
+        int n = count > INT_MAX ? INT_MAX : (int)count;
+        if (w->len + RECORD_SIZE > OUT_BUFFER) {
+            flush_output(w);
+        }
+        memcpy(w->buffer + w->len, &n, sizeof(n));
+        w->buffer[w->len + 4] = c;
+        w->len += RECORD_SIZE;
+        count -= n;
+    }
+}
+
+// Writes a chunk's records, holding back its last run for the next chunk.
+static void write_chunk(writer_t *w, chunk_t const *chunk) {
+    char const *records = chunk->out;
+    size_t n = chunk->out_len / RECORD_SIZE;
+    if (n == 0) {
+        return;
+    }
+
+    size_t first = 0;
+    int count;
+    memcpy(&count, records, sizeof(count));
+    if (w->count > 0 && records[4] == w->c) {
+        // The previous chunk's last run goes on.
+        w->count += count;
+        first = 1;
+        if (n == 1) {
+            return;
+        }
+    }
+    emit_run(w, w->c, w->count);
+
+    // Everything between the first and the last run is final as is.
+    struct iovec iov[2] = {
+        { w->buffer, w->len },
+        { (void *)(records + first * RECORD_SIZE), (n - 1 - first) * RECORD_SIZE },
+    };
+    write_all(w, iov, 2);
+    w->len = 0;
+
+    char const *last = records + (n - 1) * RECORD_SIZE;
+    memcpy(&count, last, sizeof(count));
+    w->c = last[4];
+    w->count = count;
+}
+
+// Framed format: a chunk goes out whole, as one block.
+static void emit_bytes(writer_t *w, void const *data, size_t n) {
+    if (w->len + n > OUT_BUFFER) {
+        flush_output(w);
+    }
+    memcpy(w->buffer + w->len, data, n);
+    w->len += n;
+}
+
+static void write_block(writer_t *w, chunk_t const *chunk) {
+    w->index[2 * w->nblocks] = w->raw;
+    w->index[2 * w->nblocks + 1] = w->written + w->len;
+    w->nblocks++;
+    w->raw += chunk->len;
+
+    struct iovec iov[2] = {
+        { w->buffer, w->len },
+        { chunk->out, chunk->out_len },
+    };
+    write_all(w, iov, 2);
+    w->len = 0;
+}
+
+static void write_index(writer_t *w) {
+    uint64_t trailer[3] = { w->nblocks, w->raw, w->written + w->len };
+    for (size_t i = 0; i < w->nblocks; ++i) {
+        emit_bytes(w, &w->index[2 * i], 2 * sizeof(uint64_t));
+    }
+    emit_bytes(w, trailer, sizeof(trailer));
+    emit_bytes(w, INDEX_MAGIC, MAGIC_SIZE);
+}
+
+// Returns NULL, or what went wrong in wzip's words.
+static char const *map_input(char const *path, input_t *input) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return "cannot open file";
+    }
+
+    struct stat sbuf;
+    memset(input, 0, sizeof(*input));
+    if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+        if (sbuf.st_size > 0) {
+            void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                close(fd);
+                return "cannot read file";
+            }
+            input->data = (char const *)map;
+            input->len = sbuf.st_size;
+            input->mapped = true;
+        }
+        close(fd);
+        return NULL;
+    }
+
+    // Pipes and such can't be mapped: read them whole.
+    size_t cap = 1024 * 1024;
+    char *data = (char *)malloc(cap);
+    ssize_t n;
+    while (data != NULL && (n = read(fd, data + input->len, cap - input->len)) > 0) {
+        input->len += n;
+        if (input->len == cap) {
+            cap *= 2;
+            data = (char *)realloc(data, cap);
+        }
+    }
+    close(fd);
+    if (data == NULL) {
+        fprintf(stderr, "pzip: out of memory\n");
+        exit(1);
+    }
+    input->data = data;
+    return n == 0 ? NULL : "cannot read file";
+}
+
+static size_t env_size(char const *name, size_t fallback) {
+    char const *value = getenv(name);
+    long n = value != NULL ? atol(value) : 0;
+    return n > 0 ? (size_t)n : fallback;
+}
+
+// Sizes like 65536, 64k or 1m, as for wzip -b.
+static uint64_t parse_size(char const *arg) {
+    char *end;
+    uint64_t n = strtoull(arg, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        n <<= 10;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        n <<= 20;
+        ++end;
+    }
+    return *end == '\0' ? n : 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t blockSize = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        if (opt != 'b' || (blockSize = parse_size(optarg)) == 0 || blockSize > INT_MAX) {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind == argc) {
+        printf("pzip: file1 [file2 ...]\n");
+        return 1;
+    }
+#if defined(__x86_64__)
+    run_end = __builtin_cpu_supports("avx2") ? run_end_avx2 : run_end_sse2;
+#endif
+
+    size_t nthreads = env_size("PZIP_THREADS", get_nprocs());
+    size_t chunkSize = blockSize > 0 ? blockSize : env_size("PZIP_CHUNK", DEFAULT_CHUNK);
+    if (chunkSize > INT_MAX) {
+        chunkSize = INT_MAX;
+    }
+
+    // Like wzip, compress the files before one that can't be read and then
+    // complain.
+    input_t *inputs = (input_t *)calloc(argc, sizeof(input_t));
+    int ninputs = 0;
+    char const *error = NULL;
+    size_t nchunks = 0;
+    for (int i = optind; i < argc; ++i) {
+        error = map_input(argv[i], &inputs[ninputs]);
+        if (error != NULL) {
+            if (!inputs[ninputs].mapped) {
+                free((void *)inputs[ninputs].data);
+            }
+            break;
+        }
+        nchunks += (inputs[ninputs].len + chunkSize - 1) / chunkSize;
+        ++ninputs;
+    }
+
+    pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.chunks = (chunk_t *)calloc(nchunks + 1, sizeof(chunk_t));
+    pool.nchunks = nchunks;
+    pool.ahead = nthreads * CHUNKS_AHEAD;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    size_t k = 0;
+    for (int i = 0; i < ninputs; ++i) {
+        for (size_t off = 0; off < inputs[i].len; off += chunkSize) {
+            pool.chunks[k].data = inputs[i].data + off;
+            pool.chunks[k].len = inputs[i].len - off < chunkSize ? inputs[i].len - off : chunkSize;
+            ++k;
+        }
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_create(&threads[i], NULL, worker, &pool);
+    }
+
+    static writer_t writer;
+    if (blockSize > 0) {
+        uint32_t header[2] = { (uint32_t)blockSize, 0 };
+        writer.index = (uint64_t *)malloc(2 * (nchunks + 1) * sizeof(uint64_t));
+        emit_bytes(&writer, FRAME_MAGIC, MAGIC_SIZE);
+        emit_bytes(&writer, header, sizeof(header));
+    }
+    for (size_t i = 0; i < nchunks; ++i) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.chunks[i].done) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (blockSize > 0) {
+            write_block(&writer, &pool.chunks[i]);
+        } else {
+            write_chunk(&writer, &pool.chunks[i]);
+        }
+        free(pool.chunks[i].out);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.written++;
+        pthread_cond_broadcast(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    // wzip never gets to write the run it was in (or the index) when a
+    // file fails.
+    if (error == NULL && blockSize > 0) {
+        write_index(&writer);
+    } else if (error == NULL) {
+        emit_run(&writer, writer.c, writer.count);
+    }
+    flush_output(&writer);
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < ninputs; ++i) {
+        if (inputs[i].mapped) {
+            munmap((void *)inputs[i].data, inputs[i].len);
+        } else {
+            free((void *)inputs[i].data);
+        }
+    }
+    free(inputs);
+    free(writer.index);
+    free(pool.chunks);
+    free(threads);
+
+    if (error != NULL) {
+        printf("pzip: %s\n", error);
+        return 1;
+    }
+    return writer.failed ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+#! /bin/bash
+
+# Usage: ./bench-wserver.sh [seconds] [threads ...]
+#
+# Builds the server and wload, and serves a scratch directory with a 4 KB
+# page, a 1 MB file and spin.cgi. For each engine (ENGINES, "pool epoll"
+# by default) and number of threads (1 2 4 8 16 by default: workers for
+# pool, with -b 16, and event loops for epoll) it runs wload for
+# 'seconds' (5 by default) with:
+#
+#   static      32 clients fetching the page
+#   large       8 clients fetching the 1 MB file
+#   mixed       4 clients on /spin.cgi?1 (a second each) and 28 on the
+#               page; the page's p99 shows whether slow requests hold up
+#               fast ones
+#   keep-alive  32 clients fetching the page over kept-alive connections
+#   idle        the static load, with 1000 idle connections open
+#   headers     the static load, with requests padded to 512 bytes
+
+seconds=${1:-5}
+shift
+threads=${*:-1 2 4 8 16}
+make -s wserver wload spin.cgi || exit 1
+dir=$(mktemp -d)
+server=
+trap 'kill $server 2> /dev/null; rm -rf $dir' EXIT
+
+head -c 4096 /dev/zero | tr '\0' x > $dir/index.html
+head -c 1048576 /dev/zero | tr '\0' y > $dir/large.html
+cp spin.cgi $dir/
+port=$((20000 + RANDOM % 20000))
+
+mix=("/spin.cgi?1")
+for i in $(seq 7); do
+    mix+=("/index.html")
+done
+
+for engine in ${ENGINES:-pool epoll}; do
+    for t in $threads; do
+        ./wserver -d $dir -p $port -e $engine -t $t -b 16 > /dev/null &
+        server=$!
+        sleep 0.5
+        echo "== -e $engine -t $t, static"
+        ./wload -c 32 -n $seconds localhost $port /index.html
+        echo "== -e $engine -t $t, large"
+        ./wload -c 8 -n $seconds localhost $port /large.html
+        echo "== -e $engine -t $t, mixed"
+        ./wload -c 32 -n $seconds localhost $port "${mix[@]}"
+        echo "== -e $engine -t $t, keep-alive"
+        ./wload -c 32 -n $seconds -k localhost $port /index.html
+        echo "== -e $engine -t $t, idle"
+        ./wload -c 32 -n $seconds -i 1000 localhost $port /index.html
+        echo "== -e $engine -t $t, headers"
+        ./wload -c 32 -n $seconds -s 512 localhost $port /index.html
+        kill $server
+        wait $server 2> /dev/null
+        port=$((port + 1))
+    done
+done
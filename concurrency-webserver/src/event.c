@@ -0,0 +1,337 @@
+#define _GNU_SOURCE // accept4(), strcasestr()
+#include <sys/epoll.h>
+#include "io_helper.h"
+#include "request.h"
+#include "event.h"
+
+//
+// The epoll engine. Each loop runs in a thread of its own, with its own
+// SO_REUSEPORT listening socket (the kernel spreads new connections over
+// them) and its own epoll instance, so loops share nothing. Sockets are
+// non-blocking and registered edge-triggered for both reading and
+// writing, once: a loop must then read or write until EAGAIN before it
+// waits for the next edge. (A short read counts as EAGAIN: the socket
+// was drained, and reading again waits for the next EPOLLIN edge, which
+// saves a read() per request on kept-alive connections.)
+//
+// A connection is either reading a request, whose bytes pile up in
+// 'in' until the empty line that ends the headers arrives, or writing a
+// response, a header in 'head' followed by a file from the file cache:
+// both in one writev() if the cache holds the file's contents, else the
+// header and then sendfile(). The cache renders the header of a file
+// once, too. If the client asked for "Connection: keep-alive", the
+// connection goes back to reading afterwards; requests it has already
+// sent (pipelined) are served straight away. Otherwise, as in the
+// thread pool, the server closes it.
+//
+// SIGPIPE is ignored, so that a client that hangs up gets EPIPE rather
+// than killing the server. CGI programs write to the socket themselves,
+// so a CGI request takes the connection out of the loop: it goes back to
+// blocking mode and is handed to the child, which the loop reaps later.
+//
+
+#define MAX_EVENTS (256)
+
+typedef enum { CONN_READING, CONN_WRITING } conn_state_t;
+
+typedef struct {
+    int fd;
+    conn_state_t state;
+    int readable;       // may have bytes to read: no EAGAIN since the last edge
+    int eof;            // the client will not send anything more
+    int keep_alive;
+    char *in;           // MAXBUF + 1 bytes, NULL while idle
+    size_t in_len;
+    char *head;
+    size_t head_len;
+    size_t head_off;
+    file_t *file;
+    off_t body_len;
+    off_t body_off;
+} conn_t;
+
+static void set_nonblocking(int fd, int on) {
+    int flags = fcntl(fd, F_GETFL);
+    assert(flags >= 0);
+    assert(fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == 0);
+}
+
+static void conn_reset(conn_t *c) {
+    if (c->file == NULL)
+	free(c->head);                          // else the file cache's
+    c->head = NULL;
+    c->head_len = c->head_off = 0;
+    if (c->file != NULL)
+	file_release(c->file);
+    c->file = NULL;
+    c->body_len = c->body_off = 0;
+}
+
+static void conn_close(conn_t *c) {
+    conn_reset(c);
+    close_or_die(c->fd);
+    free(c->in);
+    free(c);
+}
+
+//
+// Returns a pointer just past the empty line that ends the request in
+// buf, or NULL if it has not all arrived yet.
+//
+static char *request_end(char *buf, size_t len) {
+    char *line = memchr(buf, '\n', len);         // skip the request line
+    while (line != NULL) {
+	line++;
+	size_t left = buf + len - line;
+	if (left >= 1 && line[0] == '\n')
+	    return line + 1;
+	if (left >= 2 && line[0] == '\r' && line[1] == '\n')
+	    return line + 2;
+	line = memchr(line, '\n', left);
+    }
+    return NULL;
+}
+
+// Returns 1 if the NUL-terminated headers ask for "Connection: keep-alive".
+static int wants_keep_alive(char *headers) {
+    char *p = headers;
+    while ((p = strcasestr(p, "\nconnection:")) != NULL) {
+	p += strlen("\nconnection:");
+	p += strspn(p, " \t");
+	if (strncasecmp(p, "keep-alive", strlen("keep-alive")) == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+// Reads what the client has sent until EAGAIN or a full buffer.
+static int conn_read(conn_t *c) {
+    if (c->in == NULL) {
+	c->in = malloc(MAXBUF + 1);
+	assert(c->in != NULL);
+    }
+    while (c->readable && c->in_len < MAXBUF && !c->eof) {
+	size_t want = MAXBUF - c->in_len;
+	ssize_t n = read(c->fd, c->in + c->in_len, want);
+	if (n > 0) {
+	    c->in_len += n;
+	    c->readable = n == want;
+	} else if (n == 0) {
+	    c->eof = 1;
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    c->readable = 0;
+	} else if (errno != EINTR) {
+	    return -1;
+	}
+    }
+    c->in[c->in_len] = '\0';
+    return 0;
+}
+
+//
+// Writes as much of the response as the socket takes. Returns 0 once it
+// is all out, 1 if the socket is full, and -1 on errors (the client went
+// away, say).
+//
+static int conn_write(conn_t *c) {
+    while (c->head_off < c->head_len || c->body_off < c->body_len) {
+	ssize_t n;
+	char *data = c->file != NULL ? c->file->data : NULL;   // no file for errors
+	if (c->head_off < c->head_len || data != NULL) {
+	    struct iovec iov[2];
+	    int iovcnt = 0;
+	    if (c->head_off < c->head_len) {
+		iov[iovcnt].iov_base = c->head + c->head_off;
+		iov[iovcnt++].iov_len = c->head_len - c->head_off;
+	    }
+	    if (data != NULL && c->body_off < c->body_len) {
+		iov[iovcnt].iov_base = data + c->body_off;
+		iov[iovcnt++].iov_len = c->body_len - c->body_off;
+	    }
+	    n = writev(c->fd, iov, iovcnt);
+	} else {
+	    off_t offset = c->body_off;
+	    n = sendfile(c->fd, c->file->fd, &offset, c->body_len - c->body_off);
+	    if (n == 0)
+		return -1;                          // the file shrank
+	}
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 1;
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	size_t h = c->head_len - c->head_off;
+	if (n < h) {
+	    c->head_off += n;
+	} else {
+	    c->head_off = c->head_len;
+	    c->body_off += n - h;
+	}
+    }
+    return 0;
+}
+
+static void conn_respond_error(conn_t *c, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char buf[2 * MAXBUF];
+    int n = request_format_error(buf, sizeof(buf), cause, errnum, shortmsg, longmsg, c->keep_alive);
+    c->head = malloc(n);
+    assert(c->head != NULL);
+    memcpy(c->head, buf, n);
+    c->head_len = n;
+}
+
+//
+// Starts on the request that ends at 'end' in c->in, and takes it out of
+// the buffer. Returns 1 if the connection went to a CGI program (and is
+// gone), 0 if a response is ready to write.
+//
+static int conn_start(conn_t *c, int epoll_fd, char *end) {
+    request_t req;
+    char buf[MAXBUF], method[MAXBUF] = "", uri[MAXBUF] = "", version[MAXBUF] = "";
+
+    char *eol = memchr(c->in, '\n', end - c->in);
+    size_t len = eol - c->in + 1;
+    memcpy(buf, c->in, len);
+    buf[len] = '\0';
+    sscanf(buf, "%s %s %s", method, uri, version);
+    printf("method:%s uri:%s version:%s\n", method, uri, version);
+
+    char saved = *end;
+    *end = '\0';
+    c->keep_alive = !c->eof && wants_keep_alive(eol);
+    *end = saved;
+    c->in_len -= end - c->in;
+    memmove(c->in, end, c->in_len + 1);
+
+    if (strcasecmp(method, "GET")) {
+	conn_respond_error(c, method, "501", "Not Implemented", "server does not implement this method");
+	return 0;
+    }
+    if (request_resolve(uri, &req) < 0) {
+	conn_respond_error(c, req.filename, req.errnum, req.shortmsg, req.longmsg);
+	return 0;
+    }
+
+    if (!req.is_static) {
+	assert(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) == 0);
+	set_nonblocking(c->fd, 0);
+	request_spawn_dynamic(c->fd, req.filename, req.cgiargs);
+	conn_close(c);
+	return 1;
+    }
+
+    c->file = req.file;
+    c->body_len = req.file->st.st_size;
+    c->head = req.file->header[c->keep_alive];
+    c->head_len = req.file->header_len[c->keep_alive];
+    return 0;
+}
+
+// Moves the connection along as far as it goes without blocking.
+static void conn_handle(conn_t *c, int epoll_fd, uint32_t events) {
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	c->readable = 1;
+    while (1) {
+	if (c->state == CONN_WRITING) {
+	    int rc = conn_write(c);
+	    if (rc == 1)
+		return;
+	    conn_reset(c);
+	    if (rc < 0 || !c->keep_alive) {
+		conn_close(c);
+		return;
+	    }
+	    c->state = CONN_READING;
+	}
+
+	if (conn_read(c) < 0) {
+	    conn_close(c);
+	    return;
+	}
+	char *end = request_end(c->in, c->in_len);
+	if (end == NULL) {
+	    if (c->eof || c->in_len == MAXBUF) {
+		conn_close(c);
+	    } else if (c->in_len == 0) {
+		// idle: keep-alive connections cost little while they wait
+		free(c->in);
+		c->in = NULL;
+	    }
+	    return;
+	}
+	if (conn_start(c, epoll_fd, end))
+	    return;
+	c->state = CONN_WRITING;
+    }
+}
+
+static void accept_all(int listen_fd, int epoll_fd) {
+    while (1) {
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    // EAGAIN: done for now; anything else (EMFILE, say) leaves the
+	    // connection in the backlog until the next one comes in
+	    return;
+	}
+	conn_t *c = calloc(1, sizeof(conn_t));
+	assert(c != NULL);
+	c->fd = fd;
+	c->state = CONN_READING;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+	assert(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0);
+	// the request has often arrived by now
+	conn_handle(c, epoll_fd, EPOLLIN);
+    }
+}
+
+static void *event_loop(void *arg) {
+    int listen_fd = *(int *) arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    assert(epoll_fd >= 0);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    assert(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == 0);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+	int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+	if (n < 0) {
+	    assert(errno == EINTR);
+	    continue;
+	}
+	for (int i = 0; i < n; i++) {
+	    if (events[i].data.ptr == NULL)
+		accept_all(listen_fd, epoll_fd);
+	    else
+		conn_handle(events[i].data.ptr, epoll_fd, events[i].events);
+	}
+	// CGI children that have finished; one that finishes while all
+	// loops sleep is a zombie until the next event
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+	    ;
+    }
+    return NULL;
+}
+
+//
+// Runs 'loops' event loops on port, the calling thread being one of
+// them. Does not return.
+//
+void event_run(int port, int loops) {
+    signal(SIGPIPE, SIG_IGN);
+    int *listen_fds = malloc(loops * sizeof(int));
+    assert(listen_fds != NULL);
+    // all bound up front, so that a port in use fails at once
+    for (int i = 0; i < loops; i++) {
+	listen_fds[i] = open_listen_fd_reuseport_or_die(port);
+	set_nonblocking(listen_fds[i], 1);
+    }
+    for (int i = 1; i < loops; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, event_loop, &listen_fds[i]);
+    }
+    event_loop(&listen_fds[0]);
+}
@@ -0,0 +1,6 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_run(int port, int loops);
+
+#endif // __EVENT_H__
@@ -0,0 +1,251 @@
+#include "io_helper.h"
+#include "request.h"
+#include "file_cache.h"
+#include <time.h>
+
+//
+// A cache of open files for static requests, keyed by path: a hot file
+// costs no open(), stat() or mmap() per request, and no formatting of
+// its header either, just the write of the response (one writev() of
+// the rendered header and the cached contents for small files, or the
+// header and sendfile() from the cached descriptor).
+//
+// It holds up to FILE_CACHE_SIZE open files, and keeps the contents of
+// those of up to FILE_INLINE_MAX bytes in memory within a budget
+// (wserver -m; FILE_CACHE_BUDGET by default). Entries live in a hash
+// table and on a CLOCK ring: a hit only sets the entry's referenced
+// bit, so lookups share a read lock, and need the write lock only to
+// add or drop entries. To make room the hand goes round the ring,
+// clearing referenced bits and dropping the first entry it finds clear.
+//
+// A file that changes is noticed by comparing a fresh stat() with the
+// cached one, at most every FILE_REVALIDATE ms per entry: a modified or
+// replaced file may be served stale for that long.
+//
+
+#define FILE_CACHE_SIZE (256)
+#define FILE_CACHE_BUCKETS (1024)
+#define FILE_REVALIDATE (1000)
+
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static file_t *buckets[FILE_CACHE_BUCKETS];
+static file_t *hand = NULL;
+static int cache_count = 0;
+static size_t cache_bytes = 0;          // of contents kept in memory
+static size_t cache_budget = FILE_CACHE_BUDGET;
+
+static long now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+    return t.tv_sec * 1000L + t.tv_nsec / 1000000;
+}
+
+static unsigned hash(char *s) {
+    unsigned h = 2166136261u;                       // FNV-1a
+    for (; *s; s++)
+	h = (h ^ (unsigned char) *s) * 16777619u;
+    return h % FILE_CACHE_BUCKETS;
+}
+
+static int same_file(struct stat *a, struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+void file_cache_set_budget(size_t bytes) {
+    cache_budget = bytes;
+}
+
+static void file_free(file_t *f) {
+    close_or_die(f->fd);
+    free(f->data);
+    free(f->header[0]);
+    free(f->header[1]);
+    free(f->path);
+    free(f);
+}
+
+// Adds f to the ring just behind the hand: the last entry it gets to.
+static void clock_insert(file_t *f) {
+    if (hand == NULL) {
+	f->clock_prev = f->clock_next = f;
+	hand = f;
+	return;
+    }
+    f->clock_next = hand;
+    f->clock_prev = hand->clock_prev;
+    hand->clock_prev->clock_next = f;
+    hand->clock_prev = f;
+}
+
+static void clock_unlink(file_t *f) {
+    if (f->clock_next == f) {
+	hand = NULL;
+	return;
+    }
+    if (hand == f)
+	hand = f->clock_next;
+    f->clock_prev->clock_next = f->clock_next;
+    f->clock_next->clock_prev = f->clock_prev;
+}
+
+// Takes f out of the cache, with the write lock held. Returns 1 if that
+// was the last reference, and f is to be freed (once the lock is let go).
+static int cache_remove(file_t *f) {
+    file_t **p = &buckets[hash(f->path)];
+    while (*p != f)
+	p = &(*p)->hash_next;
+    *p = f->hash_next;
+    clock_unlink(f);
+    f->cached = 0;
+    cache_count--;
+    if (f->data != NULL)
+	cache_bytes -= f->st.st_size;
+    return __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+//
+// Drops entries, with the write lock held, until the cache is within
+// its limits: any entry while there are too many, only entries with
+// contents while they take too many bytes (cache_bytes counts nothing
+// else, so there is always one). Returns those to be freed, chained
+// through hash_next.
+//
+static file_t *cache_evict() {
+    file_t *victims = NULL;
+    while ((cache_count > FILE_CACHE_SIZE || cache_bytes > cache_budget) && hand != NULL) {
+	file_t *f = hand;
+	if (cache_count <= FILE_CACHE_SIZE && f->data == NULL) {
+	    // over the byte budget only: dropping an entry without contents
+	    // frees no bytes, just closes a cached fd
+	    hand = f->clock_next;
+	} else if (f->referenced) {
+	    f->referenced = 0;
+	    hand = f->clock_next;
+	} else if (cache_remove(f)) {
+	    f->hash_next = victims;
+	    victims = f;
+	}
+    }
+    return victims;
+}
+
+static file_t *cache_lookup(char *path) {
+    file_t *f = buckets[hash(path)];
+    while (f != NULL && strcmp(f->path, path))
+	f = f->hash_next;
+    return f;
+}
+
+//
+// Opens path for serving. Returns NULL with errno set if it cannot be:
+// EACCES for anything but a regular file the owner may read.
+//
+static file_t *file_load(char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return NULL;
+    file_t *f = calloc(1, sizeof(file_t));
+    assert(f != NULL);
+    f->fd = fd;
+    fstat_or_die(fd, &f->st);
+    if (!S_ISREG(f->st.st_mode) || !(S_IRUSR & f->st.st_mode)) {
+	file_free(f);
+	errno = EACCES;
+	return NULL;
+    }
+    f->path = strdup(path);
+    assert(f->path != NULL);
+    for (int keep_alive = 0; keep_alive <= 1; keep_alive++) {
+	char buf[MAXBUF];
+	int n = request_format_static(buf, MAXBUF, path, f->st.st_size, keep_alive);
+	f->header[keep_alive] = malloc(n);
+	assert(f->header[keep_alive] != NULL);
+	memcpy(f->header[keep_alive], buf, n);
+	f->header_len[keep_alive] = n;
+    }
+    if (f->st.st_size <= FILE_INLINE_MAX && f->st.st_size <= cache_budget) {
+	f->data = malloc(f->st.st_size + 1);
+	assert(f->data != NULL);
+	// a file that is being written to is sent with sendfile() instead
+	if (pread(fd, f->data, f->st.st_size + 1, 0) != f->st.st_size) {
+	    free(f->data);
+	    f->data = NULL;
+	}
+    }
+    f->checked = now_ms();
+    f->refs = 1;
+    return f;
+}
+
+//
+// Finds path in the cache, or opens it and adds it. Returns 0 and sets
+// *fp to a reference the caller must give back with file_release(), or
+// -1 with errno set (ENOENT, say) if the file cannot be served.
+//
+int file_cache_open(char *path, file_t **fp) {
+    long t = now_ms();
+
+    pthread_rwlock_rdlock(&cache_lock);
+    file_t *f = cache_lookup(path);
+    if (f != NULL) {
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->referenced, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&cache_lock);
+
+    if (f != NULL && t - __atomic_load_n(&f->checked, __ATOMIC_RELAXED) < FILE_REVALIDATE) {
+	*fp = f;
+	return 0;
+    }
+    if (f != NULL) {
+	struct stat st;
+	if (stat(path, &st) == 0 && same_file(&st, &f->st)) {
+	    __atomic_store_n(&f->checked, t, __ATOMIC_RELAXED);
+	    *fp = f;
+	    return 0;
+	}
+	// changed: this entry goes, and the file is opened again
+	pthread_rwlock_wrlock(&cache_lock);
+	if (f->cached)
+	    cache_remove(f);
+	pthread_rwlock_unlock(&cache_lock);
+	file_release(f);
+    }
+
+    f = file_load(path);
+    if (f == NULL)
+	return -1;
+    pthread_rwlock_wrlock(&cache_lock);
+    // another thread may have loaded it meanwhile; the newer one wins
+    file_t *victims = NULL;
+    file_t *old = cache_lookup(path);
+    if (old != NULL && cache_remove(old))
+	victims = old;
+    f->hash_next = buckets[hash(path)];
+    buckets[hash(path)] = f;
+    clock_insert(f);
+    f->cached = 1;
+    f->refs++;                                       // the cache's own
+    cache_count++;
+    if (f->data != NULL)
+	cache_bytes += f->st.st_size;
+    file_t *evicted = cache_evict();
+    pthread_rwlock_unlock(&cache_lock);
+    if (victims != NULL)
+	victims->hash_next = evicted;
+    else
+	victims = evicted;
+    while (victims != NULL) {
+	file_t *next = victims->hash_next;
+	file_free(victims);
+	victims = next;
+    }
+    *fp = f;
+    return 0;
+}
+
+void file_release(file_t *f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	file_free(f);
+}
@@ -0,0 +1,36 @@
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <sys/stat.h>
+
+#define FILE_INLINE_MAX (65536)     // files up to this size may be kept in memory too
+#define FILE_CACHE_BUDGET (64 << 20) // default bytes of file contents kept in memory
+
+//
+// An open file that static requests can be served from, shared by every
+// response that is sending it, with its response headers rendered in
+// advance. Responses hold a reference, from file_cache_open() to
+// file_release(), so the cache may drop an entry while it is still
+// being sent.
+//
+typedef struct file {
+    char *path;
+    int fd;
+    struct stat st;
+    char *data;             // the contents, if the cache keeps them
+    char *header[2];        // the 200 response header, without and with keep-alive
+    int header_len[2];
+    long checked;           // when st was last compared with the file system, in ms
+    int refs;
+    int referenced;         // hit since the clock hand last went by
+    int cached;
+    struct file *hash_next;
+    struct file *clock_prev;
+    struct file *clock_next;
+} file_t;
+
+void file_cache_set_budget(size_t bytes);
+int file_cache_open(char *path, file_t **fp);
+void file_release(file_t *f);
+
+#endif // __FILE_CACHE_H__
@@ -1,24 +1,52 @@
 #include "io_helper.h"
 
-ssize_t readline(int fd, void *buf, size_t maxlen) {
-    char c;
+void rio_init(rio_t *rp, int fd) {
+    rp->fd = fd;
+    rp->count = 0;
+    rp->next = rp->buf;
+}
+
+// Refills an empty buffer; returns the bytes in it, 0 at EOF, -1 on errors.
+static ssize_t rio_fill(rio_t *rp) {
+    while (rp->count == 0) {
+	ssize_t n = read(rp->fd, rp->buf, RIO_BUFSIZE);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return n;
+	rp->count = n;
+	rp->next = rp->buf;
+    }
+    return rp->count;
+}
+
+//
+// Reads a line, '\n' included, of up to maxlen - 1 bytes into buf and
+// NUL-terminates it. Returns its length: 0 at EOF, -1 on errors.
+//
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen) {
     char *bufp = buf;
-    int n;
-    for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
-	int rc;
-        if ((rc = read_or_die(fd, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+    size_t n = 0;
+    while (n < maxlen - 1) {
+	ssize_t rc = rio_fill(rp);
+	if (rc < 0)
+	    return -1;
+	if (rc == 0)
+	    break;                                   // EOF
+	size_t take = maxlen - 1 - n;
+	if (take > rp->count)
+	    take = rp->count;
+	char *nl = memchr(rp->next, '\n', take);
+	if (nl != NULL)
+	    take = nl - rp->next + 1;
+	memcpy(bufp + n, rp->next, take);
+	rp->next += take;
+	rp->count -= take;
+	n += take;
+	if (nl != NULL)
+	    break;
     }
-    *bufp = '\0';
+    bufp[n] = '\0';
     return n;
 }
 
@@ -46,10 +74,15 @@ int open_client_fd(char *hostname, int port) {
     return client_fd;
 }
 
-int open_listen_fd(int port) {
+//
+// With reuse_port, several sockets can listen on the same port, and the
+// kernel spreads incoming connections over them.
+//
+static int open_listen_fd_opt(int port, int reuse_port) {
     // Create a socket descriptor 
     int listen_fd;
-    if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    // close-on-exec: CGI children have no use for it
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
 	fprintf(stderr, "socket() failed\n");
 	return -1;
     }
@@ -60,6 +93,10 @@ int open_listen_fd(int port) {
 	fprintf(stderr, "setsockopt() failed\n");
 	return -1;
     }
+    if (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+	fprintf(stderr, "setsockopt() failed\n");
+	return -1;
+    }
     
     // Listen_fd will be an endpoint for all requests to port on any IP address for this host
     struct sockaddr_in server_addr;
@@ -80,4 +117,10 @@ int open_listen_fd(int port) {
     return listen_fd;
 }
 
+int open_listen_fd(int port) {
+    return open_listen_fd_opt(port, 0);
+}
 
+int open_listen_fd_reuseport(int port) {
+    return open_listen_fd_opt(port, 1);
+}
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,15 +16,32 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 typedef struct sockaddr sockaddr_t;
 
+//
+// A buffered reader on a descriptor (the "rio" package of Bryant and
+// O'Hallaron): lines come out of a buffer refilled RIO_BUFSIZE bytes at
+// a time, instead of with one read() per byte. It may read past the
+// line, so once a descriptor has one, all reads should go through it.
+//
+#define RIO_BUFSIZE (8192)
+
+typedef struct {
+    int fd;
+    size_t count;           // unread bytes in buf, starting at next
+    char *next;
+    char buf[RIO_BUFSIZE];
+} rio_t;
+
 // useful here: gcc statement expressions
 // http://gcc.gnu.org/onlinedocs/gcc/Statement-Exprs.html
 // macro ({ ...; x; }) returns value 'x' for caller
@@ -34,6 +52,8 @@ typedef struct sockaddr sockaddr_t;
     assert(execve(filename, argv, envp) == 0); 
 #define wait_or_die(status) \
     ({ pid_t pid = wait(status); assert(pid >= 0); pid; })
+#define waitpid_or_die(pid, status, options) \
+    ({ pid_t rc = waitpid(pid, status, options); assert(rc >= 0); rc; })
 #define gethostname_or_die(name, len) \
     ({ int rc = gethostname(name, len); assert(rc == 0); rc; })
 #define setenv_or_die(name, value, overwrite) \
@@ -46,6 +66,10 @@ typedef struct sockaddr sockaddr_t;
     ({ ssize_t rc = read(fd, buf, count); assert(rc >= 0); rc; })
 #define write_or_die(fd, buf, count) \
     ({ ssize_t rc = write(fd, buf, count); assert(rc >= 0); rc; })
+#define writev_or_die(fd, iov, iovcnt) \
+    ({ ssize_t rc = writev(fd, iov, iovcnt); assert(rc >= 0); rc; })
+#define sendfile_or_die(out_fd, in_fd, offset, count) \
+    ({ ssize_t rc = sendfile(out_fd, in_fd, offset, count); assert(rc >= 0); rc; })
 #define lseek_or_die(fd, offset, whence) \
     ({ off_t rc = lseek(fd, offset, whence); assert(rc >= 0); rc; })
 #define close_or_die(fd) \
@@ -72,24 +96,32 @@ typedef struct sockaddr sockaddr_t;
     { assert(listen(s,  backlog) >= 0); }
 #define accept_or_die(s, addr, addrlen) \
     ({ int rc = accept(s, addr, addrlen); assert(rc >= 0); rc; })
+#define accept4_or_die(s, addr, addrlen, flags) \
+    ({ int rc = accept4(s, addr, addrlen, flags); assert(rc >= 0); rc; })
 #define connect_or_die(sockfd, serv_addr, addrlen) \
     { assert(connect(sockfd, serv_addr, addrlen) >= 0); }
 #define gethostbyname_or_die(name) \
     ({ struct hostent *p = gethostbyname(name); assert(p != NULL); p; })
 #define gethostbyaddr_or_die(addr, len, type) \
     ({ struct hostent *p = gethostbyaddr(addr, len, type); assert(p != NULL); p; })
+#define pthread_create_or_die(thread, attr, start_routine, arg) \
+    assert(pthread_create(thread, attr, start_routine, arg) == 0);
 
 // client/server helper functions 
-ssize_t readline(int fd, void *buf, size_t maxlen);
+void rio_init(rio_t *rp, int fd);
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen);
 int open_client_fd(char *hostname, int portno);
 int open_listen_fd(int portno);
+int open_listen_fd_reuseport(int portno);
 
 // wrappers for above
-#define readline_or_die(fd, buf, maxlen) \
-    ({ ssize_t rc = readline(fd, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_readline_or_die(rp, buf, maxlen) \
+    ({ ssize_t rc = rio_readline(rp, buf, maxlen); assert(rc >= 0); rc; })
 #define open_client_fd_or_die(hostname, port) \
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
 #define open_listen_fd_or_die(port) \
     ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define open_listen_fd_reuseport_or_die(port) \
+    ({ int rc = open_listen_fd_reuseport(port); assert(rc >= 0); rc; })
 
 #endif // __IO_HELPER__
@@ -6,13 +6,17 @@
 // Hopefully this is not a problem ... :)
 //
 
-#define MAXBUF (8192)
+//
+// Formats a whole error response into buf, which should have room for
+// 2 * MAXBUF bytes; returns its length. With keep_alive the client may
+// send another request on the connection.
+//
+int request_format_error(char *buf, size_t size, char *cause, char *errnum,
+			 char *shortmsg, char *longmsg, int keep_alive) {
+    char body[MAXBUF];
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
-    
     // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
+    snprintf(body, MAXBUF, ""
 	    "<!doctype html>\r\n"
 	    "<head>\r\n"
 	    "  <title>OSTEP WebServer Error</title>\r\n"
@@ -22,32 +26,36 @@ void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *long
 	    "  <p>%s: %s</p>\r\n"
 	    "</body>\r\n"
 	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
-    
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
-    
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
+
+    // Header first, body last
+    int n = snprintf(buf, size, ""
+		     "HTTP/1.0 %s %s\r\n"
+		     "Content-Type: text/html\r\n"
+		     "%s"
+		     "Content-Length: %lu\r\n\r\n"
+		     "%s",
+		     errnum, shortmsg, keep_alive ? "Connection: keep-alive\r\n" : "", strlen(body), body);
+    return n < size ? n : size - 1;
+}
+
+void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char buf[2 * MAXBUF];
+    int n = request_format_error(buf, sizeof(buf), cause, errnum, shortmsg, longmsg, 0);
+    write_or_die(fd, buf, n);
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Reads and discards everything up to an empty text line. Returns 0 if
+// the client hung up before sending one.
 //
-void request_read_headers(int fd) {
+int request_read_headers(rio_t *rp) {
     char buf[MAXBUF];
-    
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
-    }
-    return;
+
+    do {
+	if (rio_readline_or_die(rp, buf, MAXBUF) == 0)
+	    return 0;
+    } while (strcmp(buf, "\r\n"));
+    return 1;
 }
 
 //
@@ -56,7 +64,7 @@ void request_read_headers(int fd) {
 //
 int request_parse_uri(char *uri, char *filename, char *cgiargs) {
     char *ptr;
-    
+
     if (!strstr(uri, "cgi")) { 
 	// static
 	strcpy(cgiargs, "");
@@ -93,88 +101,157 @@ void request_get_filetype(char *filename, char *filetype) {
 	strcpy(filetype, "text/plain");
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
+//
+// Works out what to do with a GET for uri (which is modified). Returns 0
+// if the file can be served (from req->file) or the CGI program run, and
+// -1 with req->errnum and the messages set if not.
+//
+int request_resolve(char *uri, request_t *req) {
+    struct stat sbuf;
+
+    req->errnum = NULL;
+    req->file = NULL;
+    req->is_static = request_parse_uri(uri, req->filename, req->cgiargs);
+    if (req->is_static) {
+	// the cache checks the file is regular and readable
+	if (file_cache_open(req->filename, &req->file) < 0) {
+	    if (errno == ENOENT || errno == ENOTDIR) {
+		req->errnum = "404";
+		req->shortmsg = "Not found";
+		req->longmsg = "server could not find this file";
+	    } else {
+		req->errnum = "403";
+		req->shortmsg = "Forbidden";
+		req->longmsg = "server could not read this file";
+	    }
+	    return -1;
+	}
+    } else { 
+	if (stat(req->filename, &sbuf) < 0) {
+	    req->errnum = "404";
+	    req->shortmsg = "Not found";
+	    req->longmsg = "server could not find this file";
+	    return -1;
+	}
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+	    req->errnum = "403";
+	    req->shortmsg = "Forbidden";
+	    req->longmsg = "server could not run this CGI program";
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+//
+// Starts the CGI program with its stdout on fd and returns its pid; the
+// caller reaps it. The server does only a little bit of the header: the
+// CGI program has to finish writing it out.
+//
+pid_t request_spawn_dynamic(int fd, char *filename, char *cgiargs) {
     char buf[MAXBUF], *argv[] = { NULL };
-    
-    // The server does only a little bit of the header.  
-    // The CGI script has to finish writing out the header.
+
+    // Other workers may be running, so the child must not call setenv()
+    // (or anything else that may take a lock) between fork() and exec():
+    // its environment is put together here instead.
+    extern char **environ;                           // defined by libc 
+    int n = 0;
+    while (environ[n] != NULL)
+	n++;
+    char **envp = malloc((n + 2) * sizeof(char *));
+    char *query = malloc(strlen("QUERY_STRING=") + strlen(cgiargs) + 1);
+    assert(envp != NULL && query != NULL);
+    sprintf(query, "QUERY_STRING=%s", cgiargs);      // args to cgi go here
+    int k = 0;
+    envp[k++] = query;
+    for (int i = 0; i < n; i++)
+	if (strncmp(environ[i], "QUERY_STRING=", strlen("QUERY_STRING=")))
+	    envp[k++] = environ[i];
+    envp[k] = NULL;
+
     sprintf(buf, ""
 	    "HTTP/1.0 200 OK\r\n"
 	    "Server: OSTEP WebServer\r\n");
-    
+
     write_or_die(fd, buf, strlen(buf));
-    
-    if (fork_or_die() == 0) {                        // child
-	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
+
+    pid_t pid = fork_or_die();
+    if (pid == 0) {                                  // child
+	signal(SIGPIPE, SIG_DFL);                    // the epoll engine ignores it
 	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
-	extern char **environ;                       // defined by libc 
-	execve_or_die(filename, argv, environ);
-    } else {
-	wait_or_die(NULL);
+	execve_or_die(filename, argv, envp);
     }
+    free(query);
+    free(envp);
+    return pid;
+}
+
+void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
+    pid_t pid = request_spawn_dynamic(fd, filename, cgiargs);
+    // only this request's child: wait() could reap another worker's
+    waitpid_or_die(pid, NULL, 0);
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
-    
+//
+// Formats the header of a response carrying filename into buf and
+// returns its length.
+//
+int request_format_static(char *buf, size_t size, char *filename, off_t filesize, int keep_alive) {
+    char filetype[MAXBUF];
+
     request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
-    
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
-    
-    // put together response
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n"
-	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
-    
-    write_or_die(fd, buf, strlen(buf));
-    
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    int n = snprintf(buf, size, ""
+		     "HTTP/1.0 200 OK\r\n"
+		     "Server: OSTEP WebServer\r\n"
+		     "%s"
+		     "Content-Length: %lld\r\n"
+		     "Content-Type: %s\r\n\r\n",
+		     keep_alive ? "Connection: keep-alive\r\n" : "", (long long) filesize, filetype);
+    return n < size ? n : size - 1;
+}
+
+void request_serve_static(int fd, file_t *file) {
+    off_t size = file->st.st_size;
+
+    // A small file goes out with its header (rendered by the file cache)
+    // in one writev(); a larger one with sendfile(), straight from the
+    // page cache
+    struct iovec iov[2] = { { file->header[0], file->header_len[0] }, { file->data, size } };
+    writev_or_die(fd, iov, file->data != NULL ? 2 : 1);
+    if (file->data == NULL) {
+	off_t offset = 0;
+	while (offset < size && sendfile_or_die(fd, file->fd, &offset, size - offset) > 0)
+	    ;
+    }
 }
 
 // handle a request
 void request_handle(int fd) {
-    int is_static;
-    struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
-    
-    readline_or_die(fd, buf, MAXBUF);
+    request_t req;
+    rio_t rio;
+    char buf[MAXBUF], method[MAXBUF] = "", uri[MAXBUF] = "", version[MAXBUF] = "";
+
+    rio_init(&rio, fd);
+    if (rio_readline_or_die(&rio, buf, MAXBUF) == 0)
+	return;                                      // hung up without a request
     sscanf(buf, "%s %s %s", method, uri, version);
     printf("method:%s uri:%s version:%s\n", method, uri, version);
-    
+
     if (strcasecmp(method, "GET")) {
 	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
 	return;
     }
-    request_read_headers(fd);
-    
-    is_static = request_parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
+    if (!request_read_headers(&rio))
+	return;
+
+    if (request_resolve(uri, &req) < 0) {
+	request_error(fd, req.filename, req.errnum, req.shortmsg, req.longmsg);
 	return;
     }
-    
-    if (is_static) {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
-	    return;
-	}
-	request_serve_static(fd, filename, sbuf.st_size);
+    if (req.is_static) {
+	request_serve_static(fd, req.file);
+	file_release(req.file);
     } else {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
-	    return;
-	}
-	request_serve_dynamic(fd, filename, cgiargs);
+	request_serve_dynamic(fd, req.filename, req.cgiargs);
     }
 }
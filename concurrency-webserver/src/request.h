@@ -1,4 +1,33 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include <sys/types.h>
+#include "file_cache.h"
+
+#define MAXBUF (8192)
+
+//
+// What a GET for some uri turns into: a file to send, a CGI program to
+// run, or an error response. Filled in by request_resolve(), which both
+// the thread pool (request_handle) and the epoll engine use. A file to
+// send comes from the file cache, and must be given back with
+// file_release().
+//
+typedef struct {
+    int is_static;
+    char filename[MAXBUF];
+    char cgiargs[MAXBUF];
+    file_t *file;
+    char *errnum;           // NULL unless the request cannot be served
+    char *shortmsg;
+    char *longmsg;
+} request_t;
+
+int request_resolve(char *uri, request_t *req);
+int request_format_error(char *buf, size_t size, char *cause, char *errnum,
+			 char *shortmsg, char *longmsg, int keep_alive);
+int request_format_static(char *buf, size_t size, char *filename, off_t filesize, int keep_alive);
+pid_t request_spawn_dynamic(int fd, char *filename, char *cgiargs);
 
 void request_handle(int fd);
 
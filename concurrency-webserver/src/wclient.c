@@ -44,12 +44,14 @@ void client_send(int fd, char *filename) {
 void client_print(int fd) {
     char buf[MAXBUF];  
     int n;
+    rio_t rio;
     
+    rio_init(&rio, fd);
     // Read and display the HTTP Header 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
     while (strcmp(buf, "\r\n") && (n > 0)) {
 	printf("Header: %s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	n = rio_readline_or_die(&rio, buf, MAXBUF);
 	
 	// If you want to look for certain HTTP tags... 
 	// int length = 0;
@@ -59,10 +61,10 @@ void client_print(int fd) {
     }
     
     // Read and display the HTTP Body 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
     while (n > 0) {
 	printf("%s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	n = rio_readline_or_die(&rio, buf, MAXBUF);
     }
 }
 
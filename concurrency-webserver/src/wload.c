@@ -0,0 +1,278 @@
+//
+// wload.c: a load generator for wserver.
+//
+// To run, try:
+//      wload [-c clients] [-n seconds] [-k] [-i idle] [-s size] hostname portnumber uri [uri ...]
+//
+// Starts 'clients' threads (default 16) that send requests back to back
+// for 'seconds' (default 5). Client i always asks for uri number
+// i % (number of uris), so repeating a uri sets the mix: for example
+// "/spin.cgi?1 /index.html /index.html /index.html" keeps a quarter of
+// the clients on the slow CGI program. Each request gets a connection of
+// its own, since the server closes it after the response, and is timed
+// from connect() to the end of the response.
+//
+// With -k, clients ask for "Connection: keep-alive" and send their next
+// request on the same connection, as long as the server keeps it open;
+// a request is then timed from write() on reused connections. With -i,
+// 'idle' more connections are opened first and left open, without a
+// request, for the whole run: to the server they look like keep-alive
+// clients thinking between two requests. With -s, requests are padded
+// with header lines to about 'size' bytes, as a browser's often are.
+//
+// Prints, per uri and for all of them: the number of requests completed,
+// requests per second, the median, 99th percentile and maximum latency in
+// milliseconds, and the number of failed requests (no connection, no
+// "200" status, or no response within 'seconds' + 5 seconds).
+//
+
+#define _GNU_SOURCE // strcasestr()
+#include "io_helper.h"
+#include <pthread.h>
+#include <time.h>
+
+#define MAXBUF (8192)
+
+typedef struct {
+    int id;
+    char *uri;
+    double *latencies;      // in milliseconds
+    int count;
+    int capacity;
+    int errors;
+    int fd;                 // kept open with -k, else -1
+} client_t;
+
+struct sockaddr_in server_addr;
+char *host_header;
+double deadline;
+int keep_alive = 0;
+char *padding = "";
+struct timeval timeout;
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int client_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+	return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+	connect(fd, (sockaddr_t *) &server_addr, sizeof(server_addr)) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+//
+// Reads the response to a keep-alive request: the header, then as much
+// body as it says. Returns 1 if it came back with status 200, and
+// closes the connection unless the server keeps it open.
+//
+int client_response_keep_alive(client_t *c) {
+    char buf[MAXBUF + 1];
+    int len = 0;
+    char *end = NULL;
+    while (end == NULL && len < MAXBUF) {
+	ssize_t n = read(c->fd, buf + len, MAXBUF - len);
+	if (n <= 0)
+	    break;
+	len += n;
+	buf[len] = '\0';
+	end = strstr(buf, "\r\n\r\n");
+    }
+    int ok = end != NULL && len >= 12 && strncmp(buf + 8, " 200", 4) == 0;
+    char *length = ok ? strcasestr(buf, "\ncontent-length:") : NULL;
+    if (length == NULL || length > end || strcasestr(buf, "\nconnection: keep-alive") == NULL) {
+	// the server closes the connection after this response
+	ssize_t n = 1;
+	while (n > 0)
+	    n = read(c->fd, buf, MAXBUF);
+	close(c->fd);
+	c->fd = -1;
+	return ok && n == 0;
+    }
+    long left = atol(length + strlen("\ncontent-length:")) - (len - (end + 4 - buf));
+    while (left > 0) {
+	ssize_t n = read(c->fd, buf, left < MAXBUF ? left : MAXBUF);
+	if (n <= 0) {
+	    close(c->fd);
+	    c->fd = -1;
+	    return 0;
+	}
+	left -= n;
+    }
+    return 1;
+}
+
+// Returns 1 if the whole response came back with status 200.
+int client_request(client_t *c) {
+    char buf[MAXBUF];
+    if (c->fd < 0 && (c->fd = client_connect()) < 0)
+	return 0;
+    int fd = c->fd;
+    int len = snprintf(buf, MAXBUF, "GET %s HTTP/1.1\r\nhost: %s\r\n%s%s\r\n", c->uri, host_header,
+		       padding, keep_alive ? "Connection: keep-alive\r\n" : "");
+    // MSG_NOSIGNAL: the server may have closed a kept-alive connection
+    if (send(fd, buf, len, MSG_NOSIGNAL) != len) {
+	close(fd);
+	c->fd = -1;
+	return 0;
+    }
+    if (keep_alive)
+	return client_response_keep_alive(c);
+    c->fd = -1;
+
+    // The status line is in the first read, unless the server is being
+    // very stingy.
+    ssize_t n = read(fd, buf, MAXBUF);
+    int ok = n >= 12 && strncmp(buf + 8, " 200", 4) == 0;
+    while (n > 0)
+	n = read(fd, buf, MAXBUF);
+    close(fd);
+    return ok && n == 0;
+}
+
+void *client_run(void *arg) {
+    client_t *c = arg;
+    while (now() < deadline) {
+	double start = now();
+	if (!client_request(c)) {
+	    c->errors++;
+	    continue;
+	}
+	if (c->count == c->capacity) {
+	    c->capacity = c->capacity ? 2 * c->capacity : 1024;
+	    c->latencies = realloc(c->latencies, c->capacity * sizeof(double));
+	    assert(c->latencies != NULL);
+	}
+	c->latencies[c->count++] = (now() - start) * 1000;
+    }
+    return NULL;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Prints the statistics of the clients for which 'pick' is set.
+void print_stats(char *label, client_t *clients, int nclients, int *pick, double seconds) {
+    int total = 0, errors = 0;
+    for (int i = 0; i < nclients; i++) {
+	if (pick[i]) {
+	    total += clients[i].count;
+	    errors += clients[i].errors;
+	}
+    }
+    double *all = malloc((total + 1) * sizeof(double));
+    assert(all != NULL);
+    int k = 0;
+    for (int i = 0; i < nclients; i++) {
+	if (pick[i]) {
+	    memcpy(all + k, clients[i].latencies, clients[i].count * sizeof(double));
+	    k += clients[i].count;
+	}
+    }
+    qsort(all, total, sizeof(double), compare_doubles);
+    double p50 = total ? all[(total - 1) / 2] : 0;
+    double p99 = total ? all[(int) ((total - 1) * 0.99)] : 0;
+    double max = total ? all[total - 1] : 0;
+    printf("%-24s %9d %9.1f %9.2f %9.2f %9.2f %7d\n",
+	   label, total, total / seconds, p50, p99, max, errors);
+    free(all);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    int nclients = 16;
+    int nidle = 0;
+    int size = 0;
+    double seconds = 5;
+
+    while ((c = getopt(argc, argv, "c:n:ki:s:")) != -1)
+	switch (c) {
+	case 'c':
+	    nclients = atoi(optarg);
+	    break;
+	case 'n':
+	    seconds = atof(optarg);
+	    break;
+	case 'k':
+	    keep_alive = 1;
+	    break;
+	case 'i':
+	    nidle = atoi(optarg);
+	    break;
+	case 's':
+	    size = atoi(optarg);
+	    break;
+	default:
+	    nclients = 0;
+	}
+    if (nclients <= 0 || seconds <= 0 || nidle < 0 || size < 0 || size > MAXBUF / 2 || argc - optind < 3) {
+	fprintf(stderr, "usage: wload [-c clients] [-n seconds] [-k] [-i idle] [-s size] host port uri [uri ...]\n");
+	exit(1);
+    }
+    host_header = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    char **uris = argv + optind + 2;
+    int nuris = argc - optind - 2;
+    timeout.tv_sec = (int) seconds + 5;
+
+    // lines of 64 bytes, counting the request line and host header as one
+    padding = calloc(size + 64, 1);
+    assert(padding != NULL);
+    for (int i = 1; i < size / 64; i++)
+	sprintf(padding + strlen(padding), "X-Padding-%02d: %048d\r\n", i, 0);
+
+    // Resolved once: gethostbyname() is not safe to share between threads.
+    struct hostent *hp = gethostbyname_or_die(host_header);
+    bzero((char *) &server_addr, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    bcopy((char *) hp->h_addr, (char *) &server_addr.sin_addr.s_addr, hp->h_length);
+    server_addr.sin_port = htons(port);
+
+    for (int i = 0; i < nidle; i++) {
+	if (client_connect() < 0) {
+	    fprintf(stderr, "wload: could only open %d idle connections\n", i);
+	    exit(1);
+	}
+    }
+
+    client_t *clients = calloc(nclients, sizeof(client_t));
+    pthread_t *threads = malloc(nclients * sizeof(pthread_t));
+    int *pick = malloc(nclients * sizeof(int));
+    assert(clients != NULL && threads != NULL && pick != NULL);
+    double start = now();
+    deadline = start + seconds;
+    for (int i = 0; i < nclients; i++) {
+	clients[i].id = i;
+	clients[i].uri = uris[i % nuris];
+	clients[i].fd = -1;
+	pthread_create_or_die(&threads[i], NULL, client_run, &clients[i]);
+    }
+    for (int i = 0; i < nclients; i++)
+	pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    printf("%-24s %9s %9s %9s %9s %9s %7s\n", "uri", "requests", "req/s", "p50 ms", "p99 ms", "max ms", "errors");
+    for (int u = 0; u < nuris && nuris > 1; u++) {
+	int seen = 0;
+	for (int v = 0; v < u; v++)
+	    seen |= strcmp(uris[u], uris[v]) == 0;
+	if (seen)
+	    continue;
+	for (int i = 0; i < nclients; i++)
+	    pick[i] = strcmp(clients[i].uri, uris[u]) == 0;
+	print_stats(uris[u], clients, nclients, pick, elapsed);
+    }
+    for (int i = 0; i < nclients; i++)
+	pick[i] = 1;
+    print_stats(nuris > 1 ? "all" : uris[0], clients, nclients, pick, elapsed);
+    exit(0);
+}
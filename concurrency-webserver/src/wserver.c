@@ -1,18 +1,92 @@
+#define _GNU_SOURCE // accept4()
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
 #include "request.h"
 #include "io_helper.h"
+#include "event.h"
+#include "file_cache.h"
 
 char default_root[] = ".";
 
 //
-// ./wserver [-d <basedir>] [-p <portnum>] 
-// 
+// Accepted connections wait in a bounded ring buffer until a worker takes
+// them: the master thread blocks when it is full, workers when it is
+// empty. A slow request (say, spin.cgi) then only ties up one worker,
+// and accepting overlaps with serving.
+//
+typedef struct {
+    int *fds;
+    int size;
+    int head;           // next fd to hand out
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+} conn_queue_t;
+
+void conn_queue_init(conn_queue_t *q, int size) {
+    q->fds = malloc(size * sizeof(int));
+    assert(q->fds != NULL);
+    q->size = size;
+    q->head = 0;
+    q->count = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+}
+
+void conn_queue_put(conn_queue_t *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->size)
+	pthread_cond_wait(&q->not_full, &q->lock);
+    q->fds[(q->head + q->count) % q->size] = fd;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int conn_queue_get(conn_queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+	pthread_cond_wait(&q->not_empty, &q->lock);
+    int fd = q->fds[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return fd;
+}
+
+void *worker(void *arg) {
+    conn_queue_t *q = arg;
+    while (1) {
+	int conn_fd = conn_queue_get(q);
+	request_handle(conn_fd);
+	close_or_die(conn_fd);
+    }
+    return NULL;
+}
+
+//
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-e pool|epoll] [-m <megabytes>]
+//
+// The default engine, pool, has 'threads' workers (1 by default) serving
+// connections from a queue of 'buffers'. With epoll, 'threads' is the
+// number of event loops instead, one per CPU by default (see event.c).
+// Both keep small static files in memory, up to 'megabytes' of them (64
+// by default; 0 to always send them from disk, see file_cache.c).
+//
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
+    char *engine = "pool";
     int port = 10000;
-    
-    while ((c = getopt(argc, argv, "d:p:")) != -1)
+    int threads = -1;
+    int buffers = 1;
+    int megabytes = FILE_CACHE_BUDGET >> 20;
+
+    while ((c = getopt(argc, argv, "d:p:t:b:e:m:")) != -1)
 	switch (c) {
 	case 'd':
 	    root_dir = optarg;
@@ -20,28 +94,59 @@ int main(int argc, char *argv[]) {
 	case 'p':
 	    port = atoi(optarg);
 	    break;
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'b':
+	    buffers = atoi(optarg);
+	    break;
+	case 'e':
+	    engine = optarg;
+	    break;
+	case 'm':
+	    megabytes = atoi(optarg);
+	    break;
 	default:
-	    fprintf(stderr, "usage: wserver [-d basedir] [-p port]\n");
+	    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffers] [-e pool|epoll] [-m megabytes]\n");
 	    exit(1);
 	}
+    int epoll = strcmp(engine, "epoll") == 0;
+    if (threads == -1)
+	threads = epoll ? get_nprocs() : 1;
+    if (threads <= 0 || buffers <= 0 || megabytes < 0 || (!epoll && strcmp(engine, "pool"))) {
+	fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffers] [-e pool|epoll] [-m megabytes]\n");
+	exit(1);
+    }
 
     // run out of this directory
     chdir_or_die(root_dir);
+    file_cache_set_budget((size_t) megabytes << 20);
+
+    if (epoll)
+	event_run(port, threads);
+
+    conn_queue_t queue;
+    conn_queue_init(&queue, buffers);
+    for (int i = 0; i < threads; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, worker, &queue);
+    }
 
     // now, get to work
     int listen_fd = open_listen_fd_or_die(port);
     while (1) {
 	struct sockaddr_in client_addr;
 	int client_len = sizeof(client_addr);
-	int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
-	request_handle(conn_fd);
-	close_or_die(conn_fd);
+	// close-on-exec, so that a CGI child forked by one worker does not
+	// keep other connections open
+	int conn_fd = accept4_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len, SOCK_CLOEXEC);
+	conn_queue_put(&queue, conn_fd);
     }
     return 0;
 }
 
 
-    
 
 
- 
+
+
@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define MIN_CHUNK_BYTES (64 * 1024)
+#define MAX_CHUNK_BYTES (64 * 1024 * 1024)
+
+void arena_init(arena_t *arena) {
+    arena->head = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+    arena->bytes = 0;
+}
+
+void arena_reset(arena_t *arena) {
+    chunk_t *chunk = arena->head;
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(arena);
+}
+
+static void add_chunk(arena_t *arena, size_t size) {
+    // Double the previous chunk, so the number of chunks stays logarithmic.
+    size_t chunkSize = arena->head == NULL ? MIN_CHUNK_BYTES : arena->head->size * 2;
+    if (chunkSize > MAX_CHUNK_BYTES) {
+        chunkSize = MAX_CHUNK_BYTES;
+    }
+    if (chunkSize < size) {
+        chunkSize = size;
+    }
+
+    chunk_t *chunk = (chunk_t *)malloc(sizeof(chunk_t) + chunkSize);
+    if (chunk == NULL) {
+        fprintf(stderr, "kv: out of memory\n");
+        exit(1);
+    }
+    chunk->next = arena->head;
+    chunk->size = chunkSize;
+    arena->head = chunk;
+    arena->next = chunk->data;
+    arena->end = chunk->data + chunkSize;
+}
+
+static char *bump(arena_t *arena, size_t align, size_t size) {
+    uintptr_t p = ((uintptr_t)arena->next + align - 1) & ~(uintptr_t)(align - 1);
+    if (arena->next == NULL || p + size > (uintptr_t)arena->end) {
+        add_chunk(arena, size + align);
+        p = ((uintptr_t)arena->next + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    arena->next = (char *)(p + size);
+    arena->bytes += size;
+    return (char *)p;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    return bump(arena, 8, size);
+}
+
+char *arena_strdup(arena_t *arena, char const *str) {
+    size_t size = strlen(str) + 1;
+    char *copy = bump(arena, 1, size);
+    memcpy(copy, str, size);
+    return copy;
+}
@@ -0,0 +1,34 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+//
+// Bump allocator. Memory comes from a list of chunks that double in size
+// as the arena grows, so loading N entries costs O(log N) calls to malloc.
+// Nothing is freed individually: arena_reset drops everything at once.
+//
+
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t size;            // usable bytes after the header
+    char data[];
+} chunk_t;
+
+typedef struct Arena {
+    chunk_t *head;          // chunk being carved up; older ones follow
+    char *next;             // first free byte in head
+    char *end;              // one past the last byte of head
+    size_t bytes;           // bytes handed out since the last reset
+} arena_t;
+
+void arena_init(arena_t *arena);
+// Frees every chunk; the arena can be used again afterwards.
+void arena_reset(arena_t *arena);
+
+// 8-byte aligned.
+void *arena_alloc(arena_t *arena, size_t size);
+// Packed with no alignment, since strings don't need any.
+char *arena_strdup(arena_t *arena, char const *str);
+
+#endif // __ARENA_H__
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdb.h"
+
+static shard_t *shard_for(cdb_t *cdb, char const *key) {
+    // Each shard indexes its table with the low bits of the same hash, so
+    // pick the shard with the high ones.
+    return &cdb->shards[db_hash(key) >> (32 - CDB_SHARD_BITS)];
+}
+
+cdb_t *cdb_create(void) {
+    cdb_t *cdb = (cdb_t *)aligned_alloc(64, sizeof(cdb_t));
+    if (cdb == NULL) {
+        fprintf(stderr, "kv: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < CDB_SHARDS; ++i) {
+        pthread_rwlock_init(&cdb->shards[i].lock, NULL);
+        cdb->shards[i].db = db_create(false);
+    }
+    return cdb;
+}
+
+void cdb_destroy(cdb_t *cdb) {
+    for (int i = 0; i < CDB_SHARDS; ++i) {
+        pthread_rwlock_destroy(&cdb->shards[i].lock);
+        db_destroy(cdb->shards[i].db);
+    }
+    free(cdb);
+}
+
+size_t cdb_size(cdb_t *cdb) {
+    size_t size = 0;
+    for (int i = 0; i < CDB_SHARDS; ++i) {
+        pthread_rwlock_rdlock(&cdb->shards[i].lock);
+        size += db_size(cdb->shards[i].db);
+        pthread_rwlock_unlock(&cdb->shards[i].lock);
+    }
+    return size;
+}
+
+bool cdb_get(cdb_t *cdb, char const *key, char *value, size_t cap) {
+    shard_t *shard = shard_for(cdb, key);
+    pthread_rwlock_rdlock(&shard->lock);
+    entry_t const *entry = db_get(shard->db, key);
+    // A NULL value marks a deleted key, as in the store's change table.
+    bool found = entry != NULL && entry->value != NULL;
+    if (found && cap > 0) {
+        strncpy(value, entry->value, cap - 1);
+        value[cap - 1] = '\0';
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
+}
+
+void cdb_put(cdb_t *cdb, char const *key, char const *value) {
+    shard_t *shard = shard_for(cdb, key);
+    pthread_rwlock_wrlock(&shard->lock);
+    db_put(shard->db, key, value);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+bool cdb_delete(cdb_t *cdb, char const *key) {
+    shard_t *shard = shard_for(cdb, key);
+    pthread_rwlock_wrlock(&shard->lock);
+    bool deleted = db_delete(shard->db, key);
+    pthread_rwlock_unlock(&shard->lock);
+    return deleted;
+}
+
+void cdb_clear(cdb_t *cdb) {
+    // Take every lock, always in shard order, so that nobody sees a
+    // half-cleared table.
+    for (int i = 0; i < CDB_SHARDS; ++i) {
+        pthread_rwlock_wrlock(&cdb->shards[i].lock);
+    }
+    for (int i = 0; i < CDB_SHARDS; ++i) {
+        db_clear(cdb->shards[i].db);
+    }
+    for (int i = CDB_SHARDS - 1; i >= 0; --i) {
+        pthread_rwlock_unlock(&cdb->shards[i].lock);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __CDB_H__
+#define __CDB_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "db.h"
+
+//
+// Thread-safe variant of db_t. Keys are spread over independent shards by
+// the top bits of their hash; each shard is a plain db_t behind its own
+// reader-writer lock. Readers of a shard run in parallel, and writers only
+// serialize with operations that land on the same shard.
+//
+
+#define CDB_SHARD_BITS 6
+#define CDB_SHARDS (1 << CDB_SHARD_BITS)
+
+// Aligned so that neighbouring locks sit on separate cache lines.
+typedef struct Shard {
+    pthread_rwlock_t lock;
+    db_t *db;
+} __attribute__((aligned(64))) shard_t;
+
+typedef struct CDB {
+    shard_t shards[CDB_SHARDS];
+} cdb_t;
+
+cdb_t *cdb_create(void);
+void cdb_destroy(cdb_t *cdb);
+
+size_t cdb_size(cdb_t *cdb);
+
+// Entries can change under other threads, so the value is copied out
+// (truncated to 'cap' bytes, always NUL-terminated). Returns false if the
+// key is absent.
+bool cdb_get(cdb_t *cdb, char const *key, char *value, size_t cap);
+void cdb_put(cdb_t *cdb, char const *key, char const *value);
+bool cdb_delete(cdb_t *cdb, char const *key);
+void cdb_clear(cdb_t *cdb);
+
+#endif // __CDB_H__
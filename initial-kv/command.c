@@ -0,0 +1,28 @@
+#include <string.h>
+
+#include "command.h"
+
+bool command_parse(char *line, command_t *cmd) {
+    int curIdx = 0;
+    char *args[3] = { NULL, NULL, NULL };
+    char *token = NULL;
+
+    while (curIdx < 3 && (token = strsep(&line, ",")) != NULL) {
+        args[curIdx++] = token;
+    }
+
+    // Exactly one letter, and no fields past the ones the command takes.
+    char op = args[0][0];
+    if (op == '\0' || args[0][1] != '\0' || line != NULL) {
+        return false;
+    }
+    int nargs = op == 'p' || op == 'r' ? 3 : op == 'g' || op == 'd' ? 2 : op == 'c' || op == 'a' ? 1 : 0;
+    if (curIdx != nargs) {
+        return false;
+    }
+
+    cmd->op = op;
+    cmd->key = args[1];
+    cmd->value = args[2];
+    return true;
+}
@@ -0,0 +1,22 @@
+#ifndef __COMMAND_H__
+#define __COMMAND_H__
+
+#include <stdbool.h>
+
+//
+// A command in command-line syntax, as given to kv on the command line,
+// in a batch file or over a connection: "p,k,v", "g,k", "d,k", "c", "a"
+// or "r,k1,k2".
+//
+
+typedef struct Command {
+    char op;                // 'p', 'g', 'd', 'c', 'a' or 'r'
+    char *key;              // the start of the range for 'r'
+    char *value;            // the end of the range for 'r'
+} command_t;
+
+// Splits 'line' in place. Returns false if it is not a well-formed command:
+// an unknown letter, or too few or too many fields.
+bool command_parse(char *line, command_t *cmd);
+
+#endif // __COMMAND_H__
@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+
+#define MIN_CAPACITY 16
+// Grow once the table would be more than 7/8 full.
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+// Old slots visited per write while a resize is in progress. Anything >= 2
+// guarantees the old table is drained before the new one fills up.
+#define MIGRATE_STEP 32
+
+//
+// Word-at-a-time hash in the style of wyhash: eight bytes are loaded at
+// once and folded in with a 64x64->128 bit multiply, whose high and low
+// halves are xored together. Keys of up to 16 bytes (all the usual ones)
+// take two or three multiplies and no loop.
+//
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read64(uint8_t const *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(uint8_t const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t db_hash_bytes(void const *key, size_t len) {
+    uint8_t const *p = (uint8_t const *)key;
+    uint64_t seed = HASH_P0;
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping 4-byte reads from each end cover 4..16 bytes.
+            size_t mid = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + mid);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = len;
+        while (left > 16) {
+            seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        // The last 16 bytes, possibly overlapping the previous block.
+        a = read64(p + left - 16);
+        b = read64(p + left - 8);
+    }
+
+    uint64_t h = hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed ^ HASH_P2));
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t db_hash(char const *str) {
+    return db_hash_bytes(str, strlen(str));
+}
+
+static void table_init(table_t *t, size_t capacity) {
+    t->slots = (entry_t *)calloc(capacity, sizeof(entry_t));
+    if (t->slots == NULL) {
+        fprintf(stderr, "kv: out of memory\n");
+        exit(1);
+    }
+    t->capacity = capacity;
+    t->count = 0;
+}
+
+static void table_free(table_t *t) {
+    free(t->slots);
+    t->slots = NULL;
+    t->capacity = 0;
+    t->count = 0;
+}
+
+// How far the entry sitting in slot 'idx' is from its home slot.
+static size_t probe_distance(table_t const *t, uint32_t hash, size_t idx) {
+    return (idx - (hash & (t->capacity - 1))) & (t->capacity - 1);
+}
+
+static entry_t *table_find(table_t const *t, uint32_t hash, char const *key, uint32_t keyLength) {
+    if (t->count == 0) {
+        return NULL;
+    }
+
+    size_t mask = t->capacity - 1;
+    size_t idx = hash & mask;
+    for (size_t dist = 0;; ++dist, idx = (idx + 1) & mask) {
+        entry_t *slot = &t->slots[idx];
+        // Robin Hood keeps every probe sequence sorted by distance, so a
+        // slot that is closer to home than we are ends the search.
+        if (slot->key == NULL || probe_distance(t, slot->hash, idx) < dist) {
+            return NULL;
+        }
+        // Hash and length reject nearly every mismatch before the key
+        // bytes (elsewhere in memory) are touched.
+        if (slot->hash == hash && slot->klen == keyLength && 0 == memcmp(slot->key, key, keyLength)) {
+            return slot;
+        }
+    }
+}
+
+// Caller guarantees the key is not present and that there is a free slot.
+static void table_insert(table_t *t, entry_t entry) {
+    size_t mask = t->capacity - 1;
+    size_t idx = entry.hash & mask;
+    size_t dist = 0;
+    for (;;) {
+        entry_t *slot = &t->slots[idx];
+        if (slot->key == NULL) {
+            *slot = entry;
+            t->count++;
+            return;
+        }
+
+        size_t slotDist = probe_distance(t, slot->hash, idx);
+        if (slotDist < dist) {
+            // Take the slot from the richer entry and keep placing it.
+            entry_t evicted = *slot;
+            *slot = entry;
+            entry = evicted;
+            dist = slotDist;
+        }
+        idx = (idx + 1) & mask;
+        ++dist;
+    }
+}
+
+// Backward-shift deletion: pull the rest of the cluster one slot closer to
+// home so that no tombstones are needed.
+static void table_remove(table_t *t, entry_t *entry) {
+    size_t mask = t->capacity - 1;
+    size_t idx = entry - t->slots;
+    for (;;) {
+        size_t next = (idx + 1) & mask;
+        entry_t *nextSlot = &t->slots[next];
+        if (nextSlot->key == NULL || probe_distance(t, nextSlot->hash, next) == 0) {
+            break;
+        }
+        t->slots[idx] = *nextSlot;
+        idx = next;
+    }
+    memset(&t->slots[idx], 0, sizeof(entry_t));
+    t->count--;
+}
+
+//
+// Moves entries from the old table into the new one. Work is done in whole
+// clusters: a cluster is emptied in one go, so lookups into what remains of
+// the old table never hit a hole in the middle of a probe sequence.
+//
+static void migrate(db_t *db, size_t budget) {
+    table_t *old = &db->old;
+    size_t mask = old->capacity - 1;
+
+    while (db->migrate_left > 0) {
+        entry_t *slot = &old->slots[db->migrate_pos];
+        if (slot->key == NULL && budget == 0) {
+            break;
+        }
+        if (slot->key != NULL) {
+            table_insert(&db->cur, *slot);
+            slot->key = NULL;
+            old->count--;
+        }
+        db->migrate_pos = (db->migrate_pos + 1) & mask;
+        db->migrate_left--;
+        if (budget > 0) {
+            budget--;
+        }
+    }
+
+    if (db->migrate_left == 0) {
+        table_free(old);
+    }
+}
+
+//
+// Ordered index.
+//
+static void skip_init(db_t *db) {
+    db->head = (skipnode_t *)arena_alloc(&db->arena, sizeof(skipnode_t) + SKIP_MAX_HEIGHT * sizeof(skipnode_t *));
+    memset(db->head, 0, sizeof(skipnode_t) + SKIP_MAX_HEIGHT * sizeof(skipnode_t *));
+    db->head->height = SKIP_MAX_HEIGHT;
+    db->height = 1;
+}
+
+// Fills 'prev' with the last node before 'key' on every level.
+static void skip_find(db_t const *db, char const *key, skipnode_t **prev) {
+    skipnode_t *node = db->head;
+    for (int level = db->height - 1; level >= 0; --level) {
+        while (node->next[level] != NULL && strcmp(node->next[level]->key, key) < 0) {
+            node = node->next[level];
+        }
+        prev[level] = node;
+    }
+}
+
+static int random_height(db_t *db) {
+    // Each level up is taken with probability 1/4.
+    db->rng ^= db->rng << 13;
+    db->rng ^= db->rng >> 7;
+    db->rng ^= db->rng << 17;
+    uint64_t bits = db->rng;
+    int height = 1;
+    while (height < SKIP_MAX_HEIGHT && (bits & 3) == 0) {
+        ++height;
+        bits >>= 2;
+    }
+    return height;
+}
+
+static skipnode_t *skip_insert(db_t *db, char *key, char *value) {
+    skipnode_t *prev[SKIP_MAX_HEIGHT];
+    skip_find(db, key, prev);
+
+    int height = random_height(db);
+    for (int level = db->height; level < height; ++level) {
+        prev[level] = db->head;
+    }
+    if (height > db->height) {
+        db->height = height;
+    }
+
+    skipnode_t *node = (skipnode_t *)arena_alloc(&db->arena, sizeof(skipnode_t) + height * sizeof(skipnode_t *));
+    node->key = key;
+    node->value = value;
+    node->height = height;
+    for (int level = 0; level < height; ++level) {
+        node->next[level] = prev[level]->next[level];
+        prev[level]->next[level] = node;
+    }
+    return node;
+}
+
+static void skip_remove(db_t *db, skipnode_t *node) {
+    skipnode_t *prev[SKIP_MAX_HEIGHT];
+    skip_find(db, node->key, prev);
+    for (int level = 0; level < node->height; ++level) {
+        prev[level]->next[level] = node->next[level];
+    }
+    while (db->height > 1 && db->head->next[db->height - 1] == NULL) {
+        --db->height;
+    }
+}
+
+skipnode_t const *db_seek(db_t const *db, char const *key) {
+    if (key == NULL) {
+        return db->head->next[0];
+    }
+    skipnode_t *prev[SKIP_MAX_HEIGHT];
+    skip_find(db, key, prev);
+    return prev[0]->next[0];
+}
+
+static void start_resize(db_t *db) {
+    db->old = db->cur;
+    table_init(&db->cur, db->old.capacity * 2);
+
+    // Start right after an empty slot so that no cluster straddles the
+    // point where the walk begins and ends.
+    size_t mask = db->old.capacity - 1;
+    size_t start = 0;
+    while (db->old.slots[start].key != NULL) {
+        start = (start + 1) & mask;
+    }
+    db->migrate_pos = (start + 1) & mask;
+    db->migrate_left = db->old.capacity;
+}
+
+db_t *db_create(bool ordered) {
+    db_t *db = (db_t *)calloc(1, sizeof(db_t));
+    if (db == NULL) {
+        fprintf(stderr, "kv: out of memory\n");
+        exit(1);
+    }
+    table_init(&db->cur, MIN_CAPACITY);
+    arena_init(&db->arena);
+    if (ordered) {
+        db->rng = 0x9e3779b97f4a7c15ull;
+        skip_init(db);
+    }
+    return db;
+}
+
+void db_destroy(db_t *db) {
+    table_free(&db->cur);
+    table_free(&db->old);
+    arena_reset(&db->arena);
+    free(db);
+}
+
+size_t db_size(db_t const *db) {
+    return db->cur.count + db->old.count;
+}
+
+entry_t *db_get(db_t const *db, char const *key) {
+    uint32_t keyLength = strlen(key);
+    uint32_t keyHash = db_hash_bytes(key, keyLength);
+    entry_t *entry = table_find(&db->cur, keyHash, key, keyLength);
+    if (entry == NULL) {
+        entry = table_find(&db->old, keyHash, key, keyLength);
+    }
+    return entry;
+}
+
+void db_put(db_t *db, char const *key, char const *value) {
+    db_put_hashed(db, db_hash(key), key, value);
+}
+
+void db_put_hashed(db_t *db, uint32_t keyHash, char const *key, char const *value) {
+    if (db->migrate_left > 0) {
+        migrate(db, MIGRATE_STEP);
+    }
+
+    uint32_t keyLength = strlen(key);
+    entry_t *entry = table_find(&db->cur, keyHash, key, keyLength);
+    if (entry == NULL) {
+        entry = table_find(&db->old, keyHash, key, keyLength);
+    }
+    char *valueCopy = value != NULL ? arena_strdup(&db->arena, value) : NULL;
+    if (entry != NULL) {
+        // Overwriting existing value.
+        entry->value = valueCopy;
+        if (entry->node != NULL) {
+            entry->node->value = valueCopy;
+        }
+        return;
+    }
+
+    if ((db_size(db) + 1) * MAX_LOAD_DEN > db->cur.capacity * MAX_LOAD_NUM) {
+        if (db->migrate_left > 0) {
+            migrate(db, SIZE_MAX);
+        }
+        start_resize(db);
+    }
+
+    char *keyCopy = arena_strdup(&db->arena, key);
+    entry_t newEntry = {
+        .hash = keyHash,
+        .klen = keyLength,
+        .key = keyCopy,
+        .value = valueCopy,
+        .node = db->head != NULL ? skip_insert(db, keyCopy, valueCopy) : NULL,
+    };
+    table_insert(&db->cur, newEntry);
+}
+
+bool db_delete(db_t *db, char const *key) {
+    if (db->migrate_left > 0) {
+        migrate(db, MIGRATE_STEP);
+    }
+
+    uint32_t keyLength = strlen(key);
+    uint32_t keyHash = db_hash_bytes(key, keyLength);
+    entry_t *entry = table_find(&db->cur, keyHash, key, keyLength);
+    if (entry != NULL) {
+        if (entry->node != NULL) {
+            skip_remove(db, entry->node);
+        }
+        table_remove(&db->cur, entry);
+        return true;
+    }
+
+    entry = table_find(&db->old, keyHash, key, keyLength);
+    if (entry != NULL) {
+        if (entry->node != NULL) {
+            skip_remove(db, entry->node);
+        }
+        table_remove(&db->old, entry);
+        return true;
+    }
+
+    return false;
+}
+
+void db_clear(db_t *db) {
+    table_free(&db->cur);
+    table_free(&db->old);
+    db->migrate_left = 0;
+    db->migrate_pos = 0;
+    table_init(&db->cur, MIN_CAPACITY);
+    bool ordered = db->head != NULL;
+    arena_reset(&db->arena);
+    if (ordered) {
+        skip_init(db);
+    }
+}
+
+entry_t const *db_next(db_t const *db, size_t *pos) {
+    // Walk the slots of 'cur' and then those of 'old' as one range.
+    while (*pos < db->cur.capacity + db->old.capacity) {
+        size_t i = (*pos)++;
+        entry_t const *entry = i < db->cur.capacity
+            ? &db->cur.slots[i]
+            : &db->old.slots[i - db->cur.capacity];
+        if (entry->key != NULL) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void db_all(db_t const *db, FILE *output) {
+    size_t pos = 0;
+    entry_t const *entry;
+    while ((entry = db_next(db, &pos)) != NULL) {
+        if (entry->value != NULL) {
+            fprintf(output, "%s,%s\n", entry->key, entry->value);
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef __DB_H__
+#define __DB_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "arena.h"
+
+//
+// In-memory table behind kv: open addressing with linear probing and
+// Robin Hood displacement. When the load factor gets too high a table of
+// twice the size is allocated and the old one is drained into it a few
+// clusters per write, so no single put pays for a full rehash.
+//
+// Key and value bytes are copied into an arena owned by the table, so a
+// load costs a handful of large allocations and clearing or destroying
+// the table doesn't walk the entries. Bytes of overwritten values and
+// deleted entries are only reclaimed by db_clear/db_destroy.
+//
+// An ordered table also keeps a skip list over the same keys, with its
+// nodes in the arena too, so range scans cost O(log n + k). Keys are
+// ordered bytewise (strcmp). The index roughly doubles the cost of puts and
+// makes deletes several times slower, so it is opt-in.
+//
+
+#define SKIP_MAX_HEIGHT 24
+
+typedef struct SkipNode {
+    char *key;
+    char *value;
+    int height;
+    struct SkipNode *next[];
+} skipnode_t;
+
+typedef struct Entry {
+    uint32_t hash;
+    uint32_t klen;      // strlen(key), checked before the key bytes
+    char *key;          // NULL marks an empty slot
+    char *value;
+    skipnode_t *node;   // this key in the ordered index, if any
+} entry_t;
+
+typedef struct Table {
+    entry_t *slots;
+    size_t capacity;    // always a power of two (or 0 when unused)
+    size_t count;
+} table_t;
+
+typedef struct DB {
+    table_t cur;
+    table_t old;            // only non-empty while a resize is in progress
+    size_t migrate_pos;     // next slot of 'old' to move into 'cur'
+    size_t migrate_left;    // slots of 'old' still to visit
+    arena_t arena;          // owns every key, value and skip list node
+    skipnode_t *head;       // skip list sentinel, NULL if not ordered
+    int height;             // tallest node currently in the list
+    uint64_t rng;           // xorshift state for node heights
+} db_t;
+
+// String hash used by the table; also used by the on-disk snapshot index.
+uint32_t db_hash(char const *str);
+// Same hash for a key whose length is already known.
+uint32_t db_hash_bytes(void const *key, size_t len);
+
+db_t *db_create(bool ordered);
+void db_destroy(db_t *db);
+
+size_t db_size(db_t const *db);
+
+// Returned entry stays valid only until the next db_put/db_delete/db_clear.
+entry_t *db_get(db_t const *db, char const *key);
+// Copies key and value; a NULL value is stored as NULL.
+void db_put(db_t *db, char const *key, char const *value);
+// Same, for a key whose db_hash() is already known (e.g. computed by
+// another thread).
+void db_put_hashed(db_t *db, uint32_t keyHash, char const *key, char const *value);
+bool db_delete(db_t *db, char const *key);
+void db_clear(db_t *db);
+
+// Iterates over all entries; start with *pos = 0, NULL means done. The
+// table must not be modified while iterating.
+entry_t const *db_next(db_t const *db, size_t *pos);
+
+// First node in key order whose key is >= 'key', or the very first node if
+// 'key' is NULL; follow node->next[0] for the rest. NULL if there is none.
+// Only for ordered tables.
+skipnode_t const *db_seek(db_t const *db, char const *key);
+// Prints "key,value" lines. Entries whose value is NULL are skipped: the
+// store uses them to record deletions of snapshot keys.
+void db_all(db_t const *db, FILE *output);
+
+#endif // __DB_H__
@@ -0,0 +1,571 @@
+//
+// kv-bench.c: compares the open-addressing db_t against the chained hash
+// table kv used to have (1000 fixed buckets, one malloc per node).
+//
+// To run, try:
+//      kv-bench [-s] [nkeys ...]
+//      kv-bench -l database.txt
+//      kv-bench -m maxthreads [nkeys]
+//      kv-bench -p maxthreads database.txt
+//      kv-bench -H [nkeys]
+//
+// -s skips the chained table, which gets very slow past ~1M keys.
+// Defaults to 1000000 and 10000000 keys. The ordered db_t (with its skip
+// list) is run too, along with a full in-order scan.
+//
+// -l loads a "key,value" text file into a db_t, one getline() and db_put
+// at a time on a single thread, and reports load time, peak RSS and the
+// cost of clearing the table. (kv -i goes through store_import, which -p
+// measures.)
+//
+// -m runs the thread-safe cdb_t with 1, 2, 4, ... maxthreads threads doing
+// random gets and puts over nkeys keys (default 1000000), at 90/10 and
+// 50/50 get/put mixes, and reports the total throughput.
+//
+// -p imports a "key,value" text file into an empty store (kv -i) and
+// exports it again (kv -e) with 1, 2, 4, ... maxthreads threads. The
+// import is timed up to the point where it would be persisted, and the
+// files the store writes (kv-bench.*) are removed afterwards.
+//
+// -H measures hash throughput for a range of key lengths (db_hash against
+// the old x31 hash), then the latency of single db_get calls on a table of
+// nkeys keys (default 1000000) and prints percentiles. Each call is timed
+// on its own, so the numbers include the clock overhead printed with them.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdb.h"
+#include "db.h"
+#include "store.h"
+
+//
+// The original chained table, kept verbatim (minus printing) as a baseline.
+//
+#define N_BUCKETS 1000
+
+typedef struct Node {
+    struct Node *next;
+    char *key;
+    char *value;
+} node_t;
+
+typedef struct Chained {
+    node_t *buckets[N_BUCKETS];
+} chained_t;
+
+static unsigned int chained_hash(char const *str) {
+    const unsigned int primeNumber = 31;
+    unsigned int curValue = 0;
+    int i = 0;
+    while (str[i] != '\0') {
+        curValue = curValue * primeNumber + str[i++];
+    }
+    return curValue;
+}
+
+static node_t *chained_get(chained_t *db, char const *key) {
+    node_t *curNode = db->buckets[chained_hash(key) % N_BUCKETS];
+    while (curNode != NULL) {
+        if (0 == strcmp(curNode->key, key)) {
+            return curNode;
+        }
+        curNode = curNode->next;
+    }
+    return NULL;
+}
+
+static void chained_put(chained_t *db, char *key, char *value) {
+    node_t *node = chained_get(db, key);
+    if (node != NULL) {
+        node->value = value;
+    } else {
+        unsigned int keyHash = chained_hash(key) % N_BUCKETS;
+        node = (node_t *)malloc(sizeof(node_t));
+        node->next = db->buckets[keyHash];
+        node->key = key;
+        node->value = value;
+        db->buckets[keyHash] = node;
+    }
+}
+
+static void chained_destroy(chained_t *db) {
+    for (int i = 0; i < N_BUCKETS; ++i) {
+        node_t *node = db->buckets[i];
+        while (node != NULL) {
+            node_t *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(db);
+}
+
+//
+// Benchmark driver
+//
+static double get_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+static void report(char const *table, char const *op, size_t n, double seconds) {
+    printf("%-8s %-8s %10zu keys %8.3f s %8.2f Mops/s\n",
+           table, op, n, seconds, n / seconds / 1e6);
+}
+
+// Keys are decimal integers (as in the kv spec), laid out in one block.
+static char **make_keys(size_t n, char const *prefix, char **storage) {
+    char **keys = (char **)malloc(n * sizeof(char *));
+    *storage = (char *)malloc(n * 24);
+    char *p = *storage;
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = p;
+        p += sprintf(p, "%s%zu", prefix, i) + 1;
+    }
+    return keys;
+}
+
+// Fisher-Yates, so lookups don't walk the table in insertion order.
+static void shuffle(char **keys, size_t n) {
+    for (size_t i = n - 1; i > 0; --i) {
+        size_t j = (size_t)rand() % (i + 1);
+        char *tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static void bench_open(char **keys, char **lookups, char **misses, size_t n, bool ordered) {
+    char const *name = ordered ? "ordered" : "open";
+    size_t found = 0;
+    db_t *db = db_create(ordered);
+
+    double t = get_seconds();
+    for (size_t i = 0; i < n; ++i) {
+        db_put(db, keys[i], keys[i]);
+    }
+    report(name, "put", n, get_seconds() - t);
+
+    t = get_seconds();
+    for (size_t i = 0; i < n; ++i) {
+        found += db_get(db, lookups[i]) != NULL;
+    }
+    report(name, "get-hit", n, get_seconds() - t);
+
+    t = get_seconds();
+    for (size_t i = 0; i < n; ++i) {
+        found += db_get(db, misses[i]) != NULL;
+    }
+    report(name, "get-miss", n, get_seconds() - t);
+
+    if (ordered) {
+        t = get_seconds();
+        size_t scanned = 0;
+        for (skipnode_t const *node = db_seek(db, NULL); node != NULL; node = node->next[0]) {
+            ++scanned;
+        }
+        report(name, "scan", scanned, get_seconds() - t);
+    }
+
+    t = get_seconds();
+    for (size_t i = 0; i < n; ++i) {
+        db_delete(db, lookups[i]);
+    }
+    report(name, "delete", n, get_seconds() - t);
+
+    if (found != n) {
+        fprintf(stderr, "kv-bench: %s table found %zu of %zu keys\n", name, found, n);
+        exit(1);
+    }
+    db_destroy(db);
+}
+
+static void bench_chained(char **keys, char **lookups, char **misses, size_t n) {
+    size_t found = 0;
+    chained_t *db = (chained_t *)calloc(1, sizeof(chained_t));
+
+    double t = get_seconds();
+    for (size_t i = 0; i < n; ++i) {
+        chained_put(db, keys[i], keys[i]);
+    }
+    report("chained", "put", n, get_seconds() - t);
+
+    t = get_seconds();
+    for (size_t i = 0; i < n; ++i) {
+        found += chained_get(db, lookups[i]) != NULL;
+    }
+    report("chained", "get-hit", n, get_seconds() - t);
+
+    t = get_seconds();
+    for (size_t i = 0; i < n; ++i) {
+        found += chained_get(db, misses[i]) != NULL;
+    }
+    report("chained", "get-miss", n, get_seconds() - t);
+
+    if (found != n) {
+        fprintf(stderr, "kv-bench: chained table found %zu of %zu keys\n", found, n);
+        exit(1);
+    }
+    chained_destroy(db);
+}
+
+static void bench_load(char const *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "kv-bench: cannot open file %s\n", path);
+        exit(1);
+    }
+
+    char *buffer = NULL;
+    size_t bufferSize = 0;
+    db_t *db = db_create(false);
+
+    double t = get_seconds();
+    while (getline(&buffer, &bufferSize, f) > 0) {
+        char *line = buffer;
+        char *key = strsep(&line, ",");
+        char *value = strsep(&line, "\n");
+        if (value != NULL) {
+            db_put(db, key, value);
+        }
+    }
+    double loadSeconds = get_seconds() - t;
+    free(buffer);
+    fclose(f);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t n = db_size(db);
+    size_t arenaBytes = db->arena.bytes;
+
+    t = get_seconds();
+    db_clear(db);
+    double clearSeconds = get_seconds() - t;
+
+    report("open", "load", n, loadSeconds);
+    printf("peak RSS %ld KiB, arena %zu KiB, clear %.6f s\n",
+           usage.ru_maxrss, arenaBytes / 1024, clearSeconds);
+    db_destroy(db);
+}
+
+#define OPS_PER_THREAD 2000000
+
+typedef struct MixArgs {
+    cdb_t *cdb;
+    char **keys;
+    size_t n;
+    int get_percent;
+    unsigned int seed;
+} mix_args_t;
+
+static void *mix_thread(void *arg) {
+    mix_args_t *args = (mix_args_t *)arg;
+    unsigned int seed = args->seed;
+    char value[32];
+
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        char *key = args->keys[rand_r(&seed) % args->n];
+        if (rand_r(&seed) % 100 < args->get_percent) {
+            cdb_get(args->cdb, key, value, sizeof(value));
+        } else {
+            cdb_put(args->cdb, key, key);
+        }
+    }
+    return NULL;
+}
+
+static void bench_threads(int max_threads, size_t n) {
+    char *keyStorage;
+    char **keys = make_keys(n, "", &keyStorage);
+    cdb_t *cdb = cdb_create();
+    for (size_t i = 0; i < n; ++i) {
+        cdb_put(cdb, keys[i], keys[i]);
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(max_threads * sizeof(pthread_t));
+    mix_args_t *args = (mix_args_t *)malloc(max_threads * sizeof(mix_args_t));
+    int mixes[] = { 90, 50 };
+
+    for (int m = 0; m < 2; ++m) {
+        for (int nthreads = 1;; nthreads *= 2) {
+            if (nthreads > max_threads) {
+                nthreads = max_threads;
+            }
+            double t = get_seconds();
+            for (int i = 0; i < nthreads; ++i) {
+                args[i] = (mix_args_t) { cdb, keys, n, mixes[m], i + 1 };
+                pthread_create(&threads[i], NULL, mix_thread, &args[i]);
+            }
+            for (int i = 0; i < nthreads; ++i) {
+                pthread_join(threads[i], NULL);
+            }
+            double seconds = get_seconds() - t;
+            printf("cdb      %d/%d get/put %3d threads %8.3f s %8.2f Mops/s\n",
+                   mixes[m], 100 - mixes[m], nthreads, seconds,
+                   (double)nthreads * OPS_PER_THREAD / seconds / 1e6);
+            if (nthreads == max_threads) {
+                break;
+            }
+        }
+    }
+
+    free(threads);
+    free(args);
+    cdb_destroy(cdb);
+    free(keys);
+    free(keyStorage);
+}
+
+static uint64_t get_nanos() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int compare_u64(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+    return x < y ? -1 : x > y;
+}
+
+#define HASH_BUFFER_BYTES (1024 * 1024)
+#define HASH_TOTAL_BYTES (512L * 1024 * 1024)
+
+// The byte-at-a-time x31 hash db_t used before db_hash, as a baseline.
+static uint32_t x31_hash(char const *str) {
+    const uint32_t primeNumber = 31;
+    uint32_t curValue = 0;
+    int i = 0;
+    while (str[i] != '\0') {
+        curValue = curValue * primeNumber + (unsigned char)str[i++];
+    }
+
+    // The table is indexed by the low bits, which a multiplicative string
+    // hash leaves poorly mixed, so finish with the murmur3 finalizer.
+    curValue ^= curValue >> 16;
+    curValue *= 0x85ebca6bu;
+    curValue ^= curValue >> 13;
+    curValue *= 0xc2b2ae35u;
+    curValue ^= curValue >> 16;
+    return curValue;
+}
+
+static void bench_hash() {
+    size_t lengths[] = { 4, 8, 16, 32, 64, 256, 1024 };
+    char *buffer = (char *)malloc(HASH_BUFFER_BYTES);
+    srand(42);
+
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+        // Back-to-back NUL-terminated keys of the given length, in cache.
+        size_t len = lengths[l];
+        size_t nkeys = HASH_BUFFER_BYTES / (len + 1);
+        for (size_t i = 0; i < nkeys * (len + 1); ++i) {
+            buffer[i] = i % (len + 1) == len ? '\0' : 'a' + rand() % 26;
+        }
+        size_t rounds = HASH_TOTAL_BYTES / (nkeys * len) + 1;
+        volatile uint32_t sink = 0;
+
+        double t = get_seconds();
+        for (size_t r = 0; r < rounds; ++r) {
+            for (size_t i = 0; i < nkeys; ++i) {
+                sink += x31_hash(buffer + i * (len + 1));
+            }
+        }
+        double x31Seconds = get_seconds() - t;
+
+        t = get_seconds();
+        for (size_t r = 0; r < rounds; ++r) {
+            for (size_t i = 0; i < nkeys; ++i) {
+                sink += db_hash_bytes(buffer + i * (len + 1), len);
+            }
+        }
+        double newSeconds = get_seconds() - t;
+
+        double bytes = (double)rounds * nkeys * len, keys = (double)rounds * nkeys;
+        printf("hash %5zu bytes  x31 %7.2f GB/s %7.2f ns/key   db_hash %7.2f GB/s %7.2f ns/key\n",
+               len, bytes / x31Seconds / 1e9, x31Seconds / keys * 1e9,
+               bytes / newSeconds / 1e9, newSeconds / keys * 1e9);
+    }
+    free(buffer);
+}
+
+static void report_latencies(char const *op, uint64_t *nanos, size_t n) {
+    qsort(nanos, n, sizeof(uint64_t), compare_u64);
+    printf("%-9s p50 %5lu ns  p90 %5lu ns  p99 %5lu ns  p99.9 %6lu ns  max %8lu ns\n", op,
+           (unsigned long)nanos[n / 2], (unsigned long)nanos[n * 9 / 10],
+           (unsigned long)nanos[n * 99 / 100], (unsigned long)nanos[n * 999 / 1000],
+           (unsigned long)nanos[n - 1]);
+}
+
+static void bench_latency(size_t n) {
+    char *keyStorage, *lookupStorage, *missStorage;
+    char **keys = make_keys(n, "", &keyStorage);
+    char **lookups = make_keys(n, "", &lookupStorage);
+    char **misses = make_keys(n, "x", &missStorage);
+    srand(42);
+    shuffle(lookups, n);
+    shuffle(misses, n);
+
+    db_t *db = db_create(false);
+    for (size_t i = 0; i < n; ++i) {
+        db_put(db, keys[i], keys[i]);
+    }
+
+    uint64_t *nanos = (uint64_t *)malloc(n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t t = get_nanos();
+        nanos[i] = get_nanos() - t;
+    }
+    report_latencies("clock", nanos, n);
+
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t t = get_nanos();
+        found += db_get(db, lookups[i]) != NULL;
+        nanos[i] = get_nanos() - t;
+    }
+    report_latencies("get-hit", nanos, n);
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t t = get_nanos();
+        found += db_get(db, misses[i]) != NULL;
+        nanos[i] = get_nanos() - t;
+    }
+    report_latencies("get-miss", nanos, n);
+
+    if (found != n) {
+        fprintf(stderr, "kv-bench: found %zu of %zu keys\n", found, n);
+        exit(1);
+    }
+    free(nanos);
+    db_destroy(db);
+    free(keys);
+    free(lookups);
+    free(misses);
+    free(keyStorage);
+    free(lookupStorage);
+    free(missStorage);
+}
+
+static void bench_text(int max_threads, char const *path) {
+    for (int nthreads = 1;; nthreads *= 2) {
+        if (nthreads > max_threads) {
+            nthreads = max_threads;
+        }
+        unlink("kv-bench.kvs");
+        unlink("kv-bench.log");
+        store_t *store = store_open("kv-bench.kvs", "kv-bench.log", NULL, nthreads);
+        if (store == NULL) {
+            exit(1);
+        }
+
+        // Inside a batch the import stops short of writing the store out.
+        store_begin_batch(store);
+        double t = get_seconds();
+        if (!store_import(store, path)) {
+            exit(1);
+        }
+        double importSeconds = get_seconds() - t;
+        size_t n = db_size(store->db);
+
+        t = get_seconds();
+        if (!store_export(store, "kv-bench.txt")) {
+            exit(1);
+        }
+        double exportSeconds = get_seconds() - t;
+
+        printf("text     %3d threads  import %8.3f s %8.2f Mlines/s  export %8.3f s %8.2f Mlines/s\n",
+               nthreads, importSeconds, n / importSeconds / 1e6, exportSeconds, n / exportSeconds / 1e6);
+        store_close(store);
+        if (nthreads == max_threads) {
+            break;
+        }
+    }
+    unlink("kv-bench.kvs");
+    unlink("kv-bench.log");
+    unlink("kv-bench.txt");
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    int skip_chained = 0;
+
+    int max_threads = 0;
+    int text_threads = 0;
+    int hash_only = 0;
+
+    while ((c = getopt(argc, argv, "sl:m:p:H")) != -1)
+        switch (c) {
+        case 's':
+            skip_chained = 1;
+            break;
+        case 'l':
+            bench_load(optarg);
+            return 0;
+        case 'm':
+            max_threads = atoi(optarg);
+            break;
+        case 'p':
+            text_threads = atoi(optarg);
+            break;
+        case 'H':
+            hash_only = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: kv-bench [-s] [nkeys ...] | -l file | -m maxthreads [nkeys] "
+                    "| -p maxthreads file | -H [nkeys]\n");
+            exit(1);
+        }
+
+    if (hash_only) {
+        bench_hash();
+        bench_latency(optind < argc ? strtoul(argv[optind], NULL, 10) : 1000000);
+        return 0;
+    }
+    if (text_threads > 0) {
+        if (optind >= argc) {
+            fprintf(stderr, "kv-bench: -p needs a text file\n");
+            exit(1);
+        }
+        bench_text(text_threads, argv[optind]);
+        return 0;
+    }
+
+    if (max_threads > 0) {
+        bench_threads(max_threads, optind < argc ? strtoul(argv[optind], NULL, 10) : 1000000);
+        return 0;
+    }
+
+    size_t default_sizes[] = { 1000000, 10000000 };
+    int nsizes = argc - optind;
+    for (int s = 0; s < (nsizes > 0 ? nsizes : 2); ++s) {
+        size_t n = nsizes > 0 ? strtoul(argv[optind + s], NULL, 10) : default_sizes[s];
+        char *keyStorage, *lookupStorage, *missStorage;
+        char **keys = make_keys(n, "", &keyStorage);
+        char **lookups = make_keys(n, "", &lookupStorage);
+        char **misses = make_keys(n, "x", &missStorage);
+        srand(42);
+        shuffle(lookups, n);
+
+        bench_open(keys, lookups, misses, n, false);
+        bench_open(keys, lookups, misses, n, true);
+        if (!skip_chained) {
+            bench_chained(keys, lookups, misses, n);
+        }
+
+        free(keys);
+        free(lookups);
+        free(misses);
+        free(keyStorage);
+        free(lookupStorage);
+        free(missStorage);
+    }
+    return 0;
+}
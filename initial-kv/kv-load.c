@@ -0,0 +1,142 @@
+//
+// kv-load.c: load generator for kv's server mode (kv -s).
+//
+// To run, try:
+//      kv -s 10000 &
+//      kv-load [-h host] [-p port] [-c conns] [-n requests] [-d depth] [-g percent] [-k keys]
+//
+// Opens 'conns' connections, one thread each. Every thread sends
+// 'requests' commands in batches of 'depth' without waiting for replies
+// (pipelining), then reads the batch's replies. 'percent' of the commands
+// are gets, the rest puts, over keys 0..keys-1. Prints the overall
+// throughput.
+//
+
+#include <pthread.h>
+#include <time.h>
+
+#include "io_helper.h"
+
+typedef struct LoadArgs {
+    char *host;
+    int port;
+    long requests;
+    int depth;
+    int get_percent;
+    long keys;
+    unsigned int seed;
+} load_args_t;
+
+static double get_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+static void *load_thread(void *arg) {
+    load_args_t *args = (load_args_t *)arg;
+    int fd = open_client_fd_or_die(args->host, args->port);
+
+    // Worst case: "p,<20 digits>,v<20 digits>\n" per command.
+    char *out = (char *)malloc((size_t)args->depth * 48);
+    char in[64 * 1024];
+    unsigned int seed = args->seed;
+
+    for (long sent = 0; sent < args->requests;) {
+        int batch = args->requests - sent < args->depth ? args->requests - sent : args->depth;
+        size_t len = 0;
+        for (int i = 0; i < batch; ++i) {
+            long key = rand_r(&seed) % args->keys;
+            if (rand_r(&seed) % 100 < args->get_percent) {
+                len += sprintf(out + len, "g,%ld\n", key);
+            } else {
+                len += sprintf(out + len, "p,%ld,v%ld\n", key, key);
+            }
+        }
+        for (size_t off = 0; off < len;) {
+            off += write_or_die(fd, out + off, len - off);
+        }
+
+        // Every put or get gets exactly one reply line.
+        int replies = 0;
+        while (replies < batch) {
+            ssize_t n = read_or_die(fd, in, sizeof(in));
+            if (n == 0) {
+                fprintf(stderr, "kv-load: server closed the connection\n");
+                exit(1);
+            }
+            for (ssize_t i = 0; i < n; ++i) {
+                replies += in[i] == '\n';
+            }
+        }
+        sent += batch;
+    }
+
+    free(out);
+    close_or_die(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    char *host = "localhost";
+    int port = 10000;
+    int conns = 4;
+    long requests = 100000;
+    int depth = 64;
+    int get_percent = 90;
+    long keys = 100000;
+
+    while ((c = getopt(argc, argv, "h:p:c:n:d:g:k:")) != -1)
+        switch (c) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'g':
+            get_percent = atoi(optarg);
+            break;
+        case 'k':
+            keys = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: kv-load [-h host] [-p port] [-c conns] [-n requests] "
+                    "[-d depth] [-g percent] [-k keys]\n");
+            exit(1);
+        }
+    if (conns < 1 || depth < 1 || keys < 1) {
+        fprintf(stderr, "kv-load: conns, depth and keys must be positive\n");
+        exit(1);
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(conns * sizeof(pthread_t));
+    load_args_t *args = (load_args_t *)malloc(conns * sizeof(load_args_t));
+
+    double t = get_seconds();
+    for (int i = 0; i < conns; ++i) {
+        args[i] = (load_args_t) { host, port, requests, depth, get_percent, keys, i + 1 };
+        pthread_create(&threads[i], NULL, load_thread, &args[i]);
+    }
+    for (int i = 0; i < conns; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = get_seconds() - t;
+
+    long total = requests * conns;
+    printf("%d conns, depth %d, %d%% gets: %ld requests in %.3f s, %.0f ops/s\n",
+           conns, depth, get_percent, total, seconds, total / seconds);
+    free(threads);
+    free(args);
+    return 0;
+}
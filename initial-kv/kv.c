@@ -1,210 +1,184 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
 
+#include "command.h"
+#include "server.h"
+#include "store.h"
 
-char const *DB_PATH = "database.txt";
-const int N_BUCKETS = 1000;
+char const *DB_PATH = "database.kvs";
+char const *LOG_PATH = "database.log";
+// Databases written by older versions of kv; imported on first use.
+char const *TEXT_PATH = "database.txt";
 
-typedef struct Node {
-    struct Node *next;
-    char *key;
-    char *value;
-} node_t;
-
-unsigned int hash(char const *str) {
-    const unsigned int primeNumber = 31;
-    unsigned int curValue = 0;
-    int i = 0;
-    while (str[i] != '\0') {
-        curValue = curValue * primeNumber + str[i++];
-    }
-
-    return curValue;
-}
-
-
-node_t *create_node(node_t *next, char *key, char *value) {
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
-    new_node->next = next;
-    new_node->key = key;
-    new_node->value = value;
-    return new_node;
-}
-
-typedef struct DB {
-    node_t *buckets[N_BUCKETS];
-} db_t;
+// Batch input is read this many bytes at a time.
+#define BATCH_CHUNK (1024 * 1024)
 
+void process_command(store_t *store, char *cmd_arguments) {
+    command_t cmd;
 
-node_t *db_get(db_t *db, char const *key) {
-    int keyHash = hash(key) % N_BUCKETS;
-    node_t *curNode = db->buckets[keyHash];
-    while (curNode != NULL) {
-        if (0 == strcmp(curNode->key, key)) {
-            return curNode;
+    if (!command_parse(cmd_arguments, &cmd)) {
+        fprintf(stdout, "bad command\n");
+    } else if (cmd.op == 'g') {
+        char const *value = store_get(store, cmd.key);
+        if (value != NULL) {
+            fprintf(stdout, "%s,%s\n", cmd.key, value);
+        } else {
+            fprintf(stdout, "%s not found\n", cmd.key);
+        }
+    } else if (cmd.op == 'p') {
+        store_put(store, cmd.key, cmd.value);
+    } else if (cmd.op == 'a') {
+        store_all(store, stdout);
+    } else if (cmd.op == 'd') {
+        if (!store_delete(store, cmd.key)) {
+            fprintf(stdout, "%s not found\n", cmd.key);
+        }
+    } else if (cmd.op == 'c') {
+        store_clear(store);
+    } else if (cmd.op == 'r') {
+        // An empty bound leaves that side of the range open.
+        store_range_t range;
+        char const *key, *value;
+        store_range(store, &range, cmd.key[0] ? cmd.key : NULL, cmd.value[0] ? cmd.value : NULL);
+        while (store_range_next(store, &range, &key, &value)) {
+            fprintf(stdout, "%s,%s\n", key, value);
         }
-        curNode = curNode->next;
-    }
-
-    return NULL;
-}
-
-void db_put(db_t *db, char *key, char *value) {
-    node_t *node = db_get(db, key);
-    if (node != NULL) {
-        // Overwriting existing value.
-        node->value = value;
-    } else {
-        unsigned int keyHash = hash(key) % N_BUCKETS;
-        db->buckets[keyHash] = create_node(db->buckets[keyHash], key, value);
     }
 }
 
-void free_node(node_t *node) {
-    free(node);
-}
-
-void db_delete(db_t *db, char const *key) {
-    int keyHash = hash(key) % N_BUCKETS;
-    node_t *curNode = db->buckets[keyHash];
-    if (curNode == NULL) {
-        fprintf(stdout, "%s not found\n", key);
-        return;
+//
+// Runs one command per line from 'path' ("-" for stdin). Input is read in
+// large chunks and each line is parsed in place; all the updates are
+// persisted in one step at the end.
+//
+bool process_batch(store_t *store, char const *path) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "kv: cannot open file %s\n", path);
+        return false;
     }
 
-    if (0 == strcmp(curNode->key, key)) {
-        db->buckets[keyHash] = curNode->next;
-        free_node(curNode);
-        return;
-    }
+    size_t cap = BATCH_CHUNK;
+    size_t len = 0;
+    char *buffer = (char *)malloc(cap + 1);
+    bool ok = true;
+    store_begin_batch(store);
 
-    while (curNode != NULL && curNode->next != NULL) {
-        if (0 == strcmp(curNode->next->key, key)) {
-            // next node has the key.
-            curNode->next = curNode->next->next;
-            free_node(curNode->next);
-            return;
+    for (;;) {
+        if (len == cap) {
+            // A single line longer than the buffer.
+            cap *= 2;
+            buffer = (char *)realloc(buffer, cap + 1);
         }
-        curNode = curNode->next;
-    }
-
-    fprintf(stdout, "%s not found\n", key);
-}
-
-void clear_node_chain(node_t *node) {
-    if (node == NULL) {
-        return;
+        ssize_t n = read(fd, buffer + len, cap - len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "kv: cannot read file %s\n", path);
+            ok = false;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+
+        char *start = buffer;
+        char *end = buffer + len;
+        char *newline;
+        while ((newline = memchr(start, '\n', end - start)) != NULL) {
+            *newline = '\0';
+            if (newline > start) {
+                process_command(store, start);
+            }
+            start = newline + 1;
+        }
+        len = end - start;
+        memmove(buffer, start, len);
     }
 
-    if (node->next != NULL) {
-        clear_node_chain(node->next);
+    // Last line without a newline.
+    if (ok && len > 0) {
+        buffer[len] = '\0';
+        process_command(store, buffer);
     }
 
-    free_node(node);
-}
-
-void db_clear(db_t *db) {
-    for (int bucketIdx = 0; bucketIdx < N_BUCKETS; ++bucketIdx) {
-        clear_node_chain(db->buckets[bucketIdx]);
-        db->buckets[bucketIdx] = NULL;
+    free(buffer);
+    if (fd != STDIN_FILENO) {
+        close(fd);
     }
+    return store_end_batch(store) && ok;
 }
 
-void db_all(db_t const *db, FILE *output) {
-    for (int bucket_idx = 0; bucket_idx < N_BUCKETS; ++bucket_idx) {
-        node_t *bucket = db->buckets[bucket_idx];
-        while (bucket != NULL) {
-            fprintf(output, "%s,%s\n", bucket->key, bucket->value);
-            bucket = bucket->next;
-        }
-    }
-}
-
-void process_command(db_t *db, char *cmd_arguments) {
-    int curIdx = 0;
-    char *args[3];
-    char *token = NULL;
-
-    while ((token = strsep(&cmd_arguments, ",")) != NULL) {
-        args[curIdx++] = token;
-    }
-
-    char cmd = args[0][0];
-    if (cmd == 'g') {
-        node_t *node = db_get(db, args[1]);
-        if (node != NULL) {
-            fprintf(stdout, "%s,%s\n", node->key, node->value);
-        } else {
-            fprintf(stdout, "%s not found\n", args[1]);
+//
+// ./kv [-i <import.txt>] [-e <export.txt>] [-f <commands>] [-s <port>] [-j <threads>] [command ...]
+//
+// -i loads "key,value" lines before running the commands, -e dumps the
+// database in the same format after them. -f runs one command per line
+// from a file ("-" for stdin) after those on the command line. -s keeps
+// the database open and serves commands over TCP until interrupted (see
+// server.h). -j sets how many threads parse imports and format exports;
+// it defaults to the number of online CPUs.
+//
+int main(int argc, char *argv[]) {
+    int c;
+    char *import_path = NULL;
+    char *export_path = NULL;
+    char *batch_path = NULL;
+    int port = -1;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt(argc, argv, "i:e:f:s:j:")) != -1)
+        switch (c) {
+        case 'i':
+            import_path = optarg;
+            break;
+        case 'e':
+            export_path = optarg;
+            break;
+        case 'f':
+            batch_path = optarg;
+            break;
+        case 's':
+            port = atoi(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: kv [-i import.txt] [-e export.txt] [-f commands] [-s port] "
+                    "[-j threads] [command ...]\n");
+            exit(1);
         }
-    } else if (cmd == 'p') {
-        db_put(db, args[1], args[2]);
-    } else if (cmd == 'a') {
-        db_all(db, stdout);
-    } else if (cmd == 'd') {
-        db_delete(db, args[1]);
-    } else if (cmd == 'c') {
-        db_clear(db);
-    }
-}
 
-db_t *load_database(char const *path) {
-    db_t *db = (db_t *)malloc(sizeof(db_t));
-    for (int i = 0; i < N_BUCKETS; ++i) {
-        db->buckets[i] = NULL;
+    store_t *store = store_open(DB_PATH, LOG_PATH, TEXT_PATH, threads);
+    if (store == NULL) {
+        return 1;
     }
-    FILE *f = fopen(path, "r");
 
-    if (f == NULL) {
-        // In this case database doesn't exist yet and we just load an empty one.
-        return db;
+    bool ok = import_path == NULL || store_import(store, import_path);
+    for (int i = optind; ok && i < argc; ++i) {
+        char *cmd_arguments = argv[i];
+        process_command(store, cmd_arguments);
     }
-    
-    char *buffer = NULL;
-    size_t bufferSize = 0;
-
-    char *key_value[2];
-    while (getline(&buffer, &bufferSize, f) > 0) {
-        key_value[0] = strsep(&buffer, ",");
-        key_value[1] = strsep(&buffer, "\n");
-        db_put(db, key_value[0], key_value[1]);
-        buffer = NULL;
+    if (ok && batch_path != NULL) {
+        ok = process_batch(store, batch_path);
     }
-
-    return db;
-}
-
-bool save_database(db_t const *db, char const *path) {
-    FILE *f = fopen(path, "w");
-    if (f == NULL) {
-        fprintf(stderr, "kv: cannot open file %s\n", path);
-        return false;
+    if (ok && port >= 0) {
+        ok = serve(store, port);
     }
-
-    db_all(db, f);
-    return true;
-}
-
-void clear_database(db_t *db) {
-    db_clear(db);
-    free(db);
-}
-
-
-int main(int argc, char *argv[]) {
-    db_t *db = load_database(DB_PATH);
-
-    for (int i = 1; i < argc; ++i) {
-        char *cmd_arguments = argv[i];
-        process_command(db, cmd_arguments);
+    if (ok && export_path != NULL) {
+        ok = store_export(store, export_path);
     }
 
-    if (!save_database(db, DB_PATH)) {
+    if (!store_close(store) || !ok) {
         return 1;
     }
-
-    clear_database(db);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "io_helper.h"
+#include "server.h"
+
+#define READ_CHUNK (64 * 1024)
+// A request line longer than this gets the connection dropped.
+#define MAX_LINE (1024 * 1024)
+// Stop reading from a client that lets this many reply bytes pile up.
+#define MAX_PENDING_OUT (4 * 1024 * 1024)
+
+typedef struct Buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+typedef struct Conn {
+    int fd;
+    buffer_t in;
+    buffer_t out;
+    size_t out_sent;        // bytes of 'out' already written to the socket
+    bool done_reading;      // peer half-closed or misbehaved; close once
+                            // the pending replies are out
+    bool broken;            // socket error: close right away
+} conn_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_stop(int sig) {
+    stopping = 1;
+}
+
+static void buffer_reserve(buffer_t *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return;
+    }
+    size_t cap = buf->cap == 0 ? 4096 : buf->cap;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    buf->data = (char *)realloc(buf->data, cap);
+    if (buf->data == NULL) {
+        fprintf(stderr, "kv: out of memory\n");
+        exit(1);
+    }
+    buf->cap = cap;
+}
+
+static void reply(conn_t *conn, char const *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    buffer_reserve(&conn->out, n + 1);
+    va_start(args, fmt);
+    vsnprintf(conn->out.data + conn->out.len, n + 1, fmt, args);
+    va_end(args);
+    conn->out.len += n;
+}
+
+static void execute(store_t *store, conn_t *conn, char *line) {
+    command_t cmd;
+
+    if (!command_parse(line, &cmd)) {
+        reply(conn, "error\n");
+    } else if (cmd.op == 'g') {
+        char const *value = store_get(store, cmd.key);
+        if (value != NULL) {
+            reply(conn, "%s,%s\n", cmd.key, value);
+        } else {
+            reply(conn, "%s not found\n", cmd.key);
+        }
+    } else if (cmd.op == 'p') {
+        store_put(store, cmd.key, cmd.value);
+        reply(conn, "ok\n");
+    } else if (cmd.op == 'a') {
+        store_iter_t it = { 0, 0 };
+        char const *key, *value;
+        while (store_next(store, &it, &key, &value)) {
+            reply(conn, "%s,%s\n", key, value);
+        }
+        reply(conn, "\n");
+    } else if (cmd.op == 'd') {
+        if (store_delete(store, cmd.key)) {
+            reply(conn, "ok\n");
+        } else {
+            reply(conn, "%s not found\n", cmd.key);
+        }
+    } else if (cmd.op == 'r') {
+        store_range_t range;
+        char const *key, *value;
+        store_range(store, &range, cmd.key[0] ? cmd.key : NULL, cmd.value[0] ? cmd.value : NULL);
+        while (store_range_next(store, &range, &key, &value)) {
+            reply(conn, "%s,%s\n", key, value);
+        }
+        reply(conn, "\n");
+    } else if (cmd.op == 'c') {
+        store_clear(store);
+        reply(conn, "ok\n");
+    }
+}
+
+// Runs every complete line in the input buffer. Returns false if the
+// client sent a line that is too long.
+static bool execute_pending(store_t *store, conn_t *conn) {
+    char *start = conn->in.data;
+    char *end = conn->in.data + conn->in.len;
+    char *newline;
+
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+        *newline = '\0';
+        if (newline > start && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        execute(store, conn, start);
+        start = newline + 1;
+    }
+
+    // Keep the partial line for the next read.
+    conn->in.len = end - start;
+    memmove(conn->in.data, start, conn->in.len);
+    return conn->in.len <= MAX_LINE;
+}
+
+static void handle_read(store_t *store, conn_t *conn) {
+    // Leave the rest in the socket if the client isn't reading its replies.
+    while (conn->out.len - conn->out_sent < MAX_PENDING_OUT) {
+        buffer_reserve(&conn->in, READ_CHUNK);
+        ssize_t n = read(conn->fd, conn->in.data + conn->in.len, READ_CHUNK);
+        if (n > 0) {
+            conn->in.len += n;
+            if (!execute_pending(store, conn)) {
+                conn->done_reading = true;
+                return;
+            }
+            continue;
+        }
+        if (n == 0) {
+            // Peer is done sending; replies already queued still go out.
+            conn->done_reading = true;
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        conn->broken = true;
+        return;
+    }
+}
+
+static void handle_write(conn_t *conn) {
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n = write(conn->fd, conn->out.data + conn->out_sent, conn->out.len - conn->out_sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->broken = true;
+            }
+            return;
+        }
+        conn->out_sent += n;
+    }
+    conn->out.len = 0;
+    conn->out_sent = 0;
+}
+
+static void conn_free(conn_t *conn) {
+    close(conn->fd);
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+bool serve(store_t *store, int port) {
+    int listen_fd = open_listen_fd(port);
+    if (listen_fd < 0) {
+        return false;
+    }
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // A client that hangs up mid-reply shows up as EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t nconns = 0, capConns = 16;
+    conn_t **conns = (conn_t **)malloc(capConns * sizeof(conn_t *));
+    struct pollfd *fds = (struct pollfd *)malloc((capConns + 1) * sizeof(struct pollfd));
+
+    while (!stopping) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < nconns; ++i) {
+            conn_t *conn = conns[i];
+            fds[i + 1].fd = conn->fd;
+            fds[i + 1].events = 0;
+            if (!conn->done_reading && conn->out.len - conn->out_sent < MAX_PENDING_OUT) {
+                fds[i + 1].events |= POLLIN;
+            }
+            if (conn->out_sent < conn->out.len) {
+                fds[i + 1].events |= POLLOUT;
+            }
+        }
+
+        if (poll(fds, nconns + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("kv: poll");
+            break;
+        }
+
+        // Serve the existing connections before accepting new ones, since
+        // accepting may grow (and move) the arrays.
+        for (size_t i = 0; i < nconns; ++i) {
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                handle_read(store, conns[i]);
+            }
+        }
+        // Log records reach the file before any client sees an "ok".
+        store_flush(store);
+
+        for (size_t i = 0; i < nconns;) {
+            conn_t *conn = conns[i];
+            if (!conn->broken) {
+                handle_write(conn);
+            }
+            bool drained = conn->out_sent == conn->out.len;
+            if (conn->broken || (conn->done_reading && drained)) {
+                conn_free(conn);
+                conns[i] = conns[--nconns];
+                continue;
+            }
+            ++i;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int conn_fd;
+            while ((conn_fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                fcntl(conn_fd, F_SETFL, O_NONBLOCK);
+                if (nconns == capConns) {
+                    capConns *= 2;
+                    conns = (conn_t **)realloc(conns, capConns * sizeof(conn_t *));
+                    fds = (struct pollfd *)realloc(fds, (capConns + 1) * sizeof(struct pollfd));
+                }
+                conn_t *conn = (conn_t *)calloc(1, sizeof(conn_t));
+                conn->fd = conn_fd;
+                conns[nconns++] = conn;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nconns; ++i) {
+        conn_free(conns[i]);
+    }
+    free(conns);
+    free(fds);
+    close(listen_fd);
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "store.h"
+
+//
+// Long-running kv: keeps the store open and serves commands over TCP.
+//
+// Requests are lines in command-line syntax ("p,k,v", "g,k", "d,k", "c",
+// "a", "r,k1,k2"), and any number of them may be sent without waiting for replies.
+// Each request gets exactly one reply, in order:
+//      p, c            "ok"
+//      d               "ok" or "K not found"
+//      g               "K,V" or "K not found"
+//      a, r            zero or more "K,V" lines, then an empty line
+//      anything else   "error"
+//
+// One thread serves every connection from a poll() loop, so commands from
+// different clients are applied one at a time and never clobber each
+// other.
+//
+
+// Returns when SIGINT or SIGTERM arrives, or on a listen error (false).
+bool serve(store_t *store, int port);
+
+#endif // __SERVER_H__
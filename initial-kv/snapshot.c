@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "snapshot.h"
+
+#define RECORD_HEADER_BYTES 8
+
+static uint32_t read_u32(char const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void corrupt(char const *path, int fd, void *map, size_t size) {
+    fprintf(stderr, "kv: %s is not a valid snapshot\n", path);
+    if (map != NULL) {
+        munmap(map, size);
+    }
+    close(fd);
+}
+
+snapshot_t *snapshot_open(char const *path) {
+    snapshot_t *snap = (snapshot_t *)calloc(1, sizeof(snapshot_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return snap;
+        }
+        fprintf(stderr, "kv: cannot open file %s\n", path);
+        free(snap);
+        return NULL;
+    }
+
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) < 0 || (size_t)sbuf.st_size < sizeof(snapshot_header_t)) {
+        corrupt(path, fd, NULL, 0);
+        free(snap);
+        return NULL;
+    }
+
+    size_t size = sbuf.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "kv: cannot map file %s\n", path);
+        close(fd);
+        free(snap);
+        return NULL;
+    }
+
+    snapshot_header_t const *header = (snapshot_header_t const *)map;
+    size_t indexBytes = header->index_slots * sizeof(snapshot_slot_t);
+    size_t orderBytes = header->count * sizeof(uint64_t);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        (header->index_slots & (header->index_slots - 1)) != 0 ||
+        header->index_slots > size / sizeof(snapshot_slot_t) ||
+        header->count > size / sizeof(uint64_t) ||
+        sizeof(*header) + indexBytes + orderBytes + header->heap_bytes != size) {
+        corrupt(path, fd, map, size);
+        free(snap);
+        return NULL;
+    }
+    // The mapping stays valid after the descriptor is gone.
+    close(fd);
+
+    snap->map = (char const *)map;
+    snap->map_size = size;
+    snap->count = header->count;
+    snap->index_slots = header->index_slots;
+    snap->index = (snapshot_slot_t const *)(snap->map + sizeof(*header));
+    snap->heap = snap->map + sizeof(*header) + indexBytes + orderBytes;
+    snap->heap_bytes = header->heap_bytes;
+    snap->order = (uint64_t const *)(snap->map + sizeof(*header) + indexBytes);
+    return snap;
+}
+
+void snapshot_close(snapshot_t *snap) {
+    if (snap->map != NULL) {
+        munmap((void *)snap->map, snap->map_size);
+    }
+    free(snap);
+}
+
+char const *snapshot_get(snapshot_t const *snap, char const *key) {
+    if (snap->index_slots == 0) {
+        return NULL;
+    }
+
+    uint32_t keyLength = strlen(key);
+    uint32_t keyHash = db_hash_bytes(key, keyLength);
+    uint64_t mask = snap->index_slots - 1;
+    for (uint64_t idx = keyHash & mask;; idx = (idx + 1) & mask) {
+        snapshot_slot_t const *slot = &snap->index[idx];
+        if (slot->offset == SNAPSHOT_EMPTY) {
+            return NULL;
+        }
+        // Hash and length reject almost every mismatch without touching
+        // the heap, which may not even be paged in yet.
+        if (slot->hash != keyHash || slot->klen != keyLength ||
+            slot->offset + RECORD_HEADER_BYTES + keyLength >= snap->heap_bytes) {
+            continue;
+        }
+        char const *record = snap->heap + slot->offset;
+        if (0 == memcmp(record + RECORD_HEADER_BYTES, key, keyLength)) {
+            return record + RECORD_HEADER_BYTES + keyLength + 1;
+        }
+    }
+}
+
+bool snapshot_next(snapshot_t const *snap, uint64_t *pos, char const **key, char const **value) {
+    if (*pos + RECORD_HEADER_BYTES > snap->heap_bytes) {
+        return false;
+    }
+    char const *record = snap->heap + *pos;
+    uint32_t keyLength = read_u32(record);
+    uint32_t valueLength = read_u32(record + 4);
+    *key = record + RECORD_HEADER_BYTES;
+    *value = *key + keyLength + 1;
+    *pos += RECORD_HEADER_BYTES + keyLength + 1 + valueLength + 1;
+    return true;
+}
+
+bool snapshot_at(snapshot_t const *snap, uint64_t pos, char const **key, char const **value) {
+    if (pos >= snap->count) {
+        return false;
+    }
+    uint64_t offset = snap->order[pos];
+    return snapshot_next(snap, &offset, key, value);
+}
+
+uint64_t snapshot_seek(snapshot_t const *snap, char const *key) {
+    if (key == NULL) {
+        return 0;
+    }
+    // Lower bound.
+    uint64_t lo = 0, hi = snap->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        char const *midKey, *midValue;
+        if (!snapshot_at(snap, mid, &midKey, &midValue) || strcmp(midKey, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool snapshot_write(char const *path, char const **keys, char const **values,
+                    size_t count, long *bytes) {
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = count;
+
+    // Keep the index at most half full so probe sequences stay short.
+    header.index_slots = count == 0 ? 0 : 1;
+    while (header.index_slots < 2 * count) {
+        header.index_slots *= 2;
+    }
+
+    snapshot_slot_t *index = (snapshot_slot_t *)malloc(header.index_slots * sizeof(snapshot_slot_t) + 1);
+    for (uint64_t i = 0; i < header.index_slots; ++i) {
+        index[i].offset = SNAPSHOT_EMPTY;
+    }
+
+    // Lay out the heap first so that the index can point into it. Records
+    // go in key order, so the order array is just their offsets.
+    uint64_t *order = (uint64_t *)malloc((count + 1) * sizeof(uint64_t));
+    uint64_t mask = header.index_slots - 1;
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = header.heap_bytes;
+        uint32_t keyLength = strlen(keys[i]);
+        uint32_t keyHash = db_hash_bytes(keys[i], keyLength);
+        uint64_t idx = keyHash & mask;
+        while (index[idx].offset != SNAPSHOT_EMPTY) {
+            idx = (idx + 1) & mask;
+        }
+        index[idx].hash = keyHash;
+        index[idx].klen = keyLength;
+        index[idx].offset = header.heap_bytes;
+        header.heap_bytes += RECORD_HEADER_BYTES + keyLength + 1 + strlen(values[i]) + 1;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "kv: cannot open file %s\n", path);
+        free(index);
+        free(order);
+        return false;
+    }
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(index, sizeof(snapshot_slot_t), header.index_slots, f);
+    fwrite(order, sizeof(uint64_t), count, f);
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t lengths[2] = { strlen(keys[i]), strlen(values[i]) };
+        fwrite(lengths, sizeof(lengths), 1, f);
+        fwrite(keys[i], 1, lengths[0] + 1, f);
+        fwrite(values[i], 1, lengths[1] + 1, f);
+    }
+    free(index);
+    free(order);
+
+    *bytes = ftell(f);
+    // On disk before it is renamed into place, or a power failure could
+    // leave an empty file under the new name.
+    bool synced = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (ferror(f) || fclose(f) != 0 || !synced) {
+        fprintf(stderr, "kv: cannot write file %s\n", path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Binary, read-only snapshot of the whole database. The file is mmap'ed
+// and queried in place, so opening it costs the same whatever its size.
+//
+// Layout (native byte order):
+//      header        snapshot_header_t
+//      index         index_slots x snapshot_slot_t, open addressing with
+//                    linear probing on db_hash(key)
+//      order         count x u64 heap offsets, sorted by key
+//      heap          packed records: u32 klen, u32 vlen, key, '\0',
+//                    value, '\0'; written in key order
+//
+// Keys and values are NUL-terminated in the file, so lookups hand out
+// pointers straight into the mapping. Keys are ordered bytewise (strcmp),
+// and the order array lets range scans binary search for their start.
+//
+
+#define SNAPSHOT_MAGIC "KVSNAP3"
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t index_slots;   // power of two, or 0 when empty
+    uint64_t heap_bytes;
+} snapshot_header_t;
+
+typedef struct SnapshotSlot {
+    uint32_t hash;
+    uint32_t klen;
+    uint64_t offset;        // into the heap; SNAPSHOT_EMPTY if unused
+} snapshot_slot_t;
+
+#define SNAPSHOT_EMPTY UINT64_MAX
+
+typedef struct Snapshot {
+    char const *map;        // NULL if there is no snapshot file yet
+    size_t map_size;
+    uint64_t count;
+    uint64_t index_slots;
+    snapshot_slot_t const *index;
+    uint64_t const *order;  // heap offsets in key order
+    char const *heap;
+    uint64_t heap_bytes;
+} snapshot_t;
+
+// A missing file opens as an empty snapshot. Returns NULL (after printing
+// an error) if the file exists but can't be mapped or isn't a snapshot.
+snapshot_t *snapshot_open(char const *path);
+void snapshot_close(snapshot_t *snap);
+
+// Returns the value, pointing into the mapping, or NULL if absent.
+char const *snapshot_get(snapshot_t const *snap, char const *key);
+
+// Iterates over records in heap order; start with *pos = 0. Returns false
+// when done.
+bool snapshot_next(snapshot_t const *snap, uint64_t *pos, char const **key, char const **value);
+
+// Position (in key order) of the first key >= 'key'; 'count' if there is
+// none. A NULL key gives the first position.
+uint64_t snapshot_seek(snapshot_t const *snap, char const *key);
+// Record at position 'pos' in key order. Returns false past the end.
+bool snapshot_at(snapshot_t const *snap, uint64_t pos, char const **key, char const **value);
+
+// Writes 'count' pairs as a new snapshot file at 'path'. Keys must be
+// distinct and sorted with strcmp. Stores the file size in *bytes.
+bool snapshot_write(char const *path, char const **keys, char const **values,
+                    size_t count, long *bytes);
+
+#endif // __SNAPSHOT_H__
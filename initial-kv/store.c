@@ -0,0 +1,704 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "store.h"
+
+// Never bother compacting a log smaller than this.
+#define COMPACT_MIN_LOG_BYTES (64 * 1024)
+
+//
+// The live view is the change table layered over the snapshot.
+//
+static void apply_put(store_t *store, char const *key, char const *value) {
+    db_put(store->db, key, value);
+}
+
+static bool apply_delete(store_t *store, char const *key) {
+    entry_t *entry = db_get(store->db, key);
+    bool inSnapshot = snapshot_get(store->snapshot, key) != NULL;
+
+    if (entry != NULL ? entry->value == NULL : !inSnapshot) {
+        return false;
+    }
+    if (inSnapshot) {
+        // Shadow the snapshot copy until the next compaction.
+        db_put(store->db, key, NULL);
+    } else {
+        db_delete(store->db, key);
+    }
+    return true;
+}
+
+// Drops the change table, and the snapshot until the next compaction.
+static void apply_clear(store_t *store) {
+    db_clear(store->db);
+    snapshot_close(store->snapshot);
+    store->snapshot = (snapshot_t *)calloc(1, sizeof(snapshot_t));
+    store->cleared = true;
+}
+
+// Changed entries first, then snapshot records the change table doesn't
+// shadow.
+bool store_next(store_t const *store, store_iter_t *it, char const **key, char const **value) {
+    entry_t const *entry;
+    while ((entry = db_next(store->db, &it->db_pos)) != NULL) {
+        if (entry->value != NULL) {
+            *key = entry->key;
+            *value = entry->value;
+            return true;
+        }
+    }
+
+    while (snapshot_next(store->snapshot, &it->snapshot_pos, key, value)) {
+        if (db_get(store->db, *key) == NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void store_range(store_t const *store, store_range_t *range, char const *start, char const *end) {
+    range->node = db_seek(store->db, start);
+    range->snapshot_pos = snapshot_seek(store->snapshot, start);
+    range->end = end;
+}
+
+// Merges the change table's skip list with the snapshot's order array; on
+// equal keys the change wins, and deletions hide the snapshot copy.
+bool store_range_next(store_t const *store, store_range_t *range, char const **key, char const **value) {
+    for (;;) {
+        char const *snapKey, *snapValue;
+        bool inSnapshot = snapshot_at(store->snapshot, range->snapshot_pos, &snapKey, &snapValue);
+        skipnode_t const *node = range->node;
+        int cmp = node == NULL ? 1 : !inSnapshot ? -1 : strcmp(node->key, snapKey);
+
+        if (node == NULL && !inSnapshot) {
+            return false;
+        }
+        if (cmp <= 0) {
+            range->node = node->next[0];
+            range->snapshot_pos += cmp == 0;
+            *key = node->key;
+            *value = node->value;
+        } else {
+            ++range->snapshot_pos;
+            *key = snapKey;
+            *value = snapValue;
+        }
+
+        if (range->end != NULL && strcmp(*key, range->end) > 0) {
+            return false;
+        }
+        if (*value != NULL) {
+            return true;
+        }
+    }
+}
+
+//
+// Text format: one "key,value" line per entry. Large files are split at
+// line boundaries over store->threads workers, which parse, hash and sort
+// their part in private arrays. The sorted arrays are then merged into the
+// table, so the ordered index is filled front to back instead of at random
+// places; ties keep file order, so the last line for a key still wins.
+// Export formats slices of the pairs in parallel and each worker writes
+// its slice at its own offset.
+//
+
+// Don't hand a worker less than this much text.
+#define TEXT_MIN_CHUNK (4 * 1024 * 1024)
+// ... or fewer than this many pairs to export.
+#define TEXT_MIN_SLICE 65536
+
+typedef struct TextPair {
+    uint32_t hash;
+    char *key;
+    char *value;
+} text_pair_t;
+
+typedef struct TextChunk {
+    char *start;
+    char *end;
+    text_pair_t *pairs;
+    size_t count;
+    size_t cap;
+} text_chunk_t;
+
+typedef struct TextSlice {
+    char const **keys;
+    char const **values;
+    size_t count;
+    char *buffer;
+    size_t len;
+    int fd;
+    off_t offset;
+    bool ok;
+} text_slice_t;
+
+// Runs fn on each of the 'n' argument structs, one thread each.
+static void run_workers(void *(*fn)(void *), void *args, size_t argSize, int n) {
+    if (n == 1) {
+        fn(args);
+        return;
+    }
+    pthread_t *threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+    for (int i = 0; i < n; ++i) {
+        pthread_create(&threads[i], NULL, fn, (char *)args + i * argSize);
+    }
+    for (int i = 0; i < n; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// By key, then by position in the file.
+static int compare_pairs(void const *a, void const *b) {
+    text_pair_t const *x = (text_pair_t const *)a;
+    text_pair_t const *y = (text_pair_t const *)b;
+    int cmp = strcmp(x->key, y->key);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static void *parse_chunk(void *arg) {
+    text_chunk_t *chunk = (text_chunk_t *)arg;
+    char *line = chunk->start;
+
+    while (line < chunk->end) {
+        char *newline = memchr(line, '\n', chunk->end - line);
+        // The byte past the last chunk is always writable (see read_text).
+        char *lineEnd = newline != NULL ? newline : chunk->end;
+        char *comma = memchr(line, ',', lineEnd - line);
+        if (comma != NULL) {
+            *comma = '\0';
+            *lineEnd = '\0';
+            if (chunk->count == chunk->cap) {
+                chunk->cap = chunk->cap == 0 ? 4096 : chunk->cap * 2;
+                chunk->pairs = (text_pair_t *)realloc(chunk->pairs, chunk->cap * sizeof(text_pair_t));
+            }
+            chunk->pairs[chunk->count++] = (text_pair_t) { db_hash_bytes(line, comma - line), line, comma + 1 };
+        }
+        line = lineEnd + 1;
+    }
+    qsort(chunk->pairs, chunk->count, sizeof(text_pair_t), compare_pairs);
+    return NULL;
+}
+
+static bool read_text(store_t *store, char const *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat sbuf;
+    if (fd < 0 || fstat(fd, &sbuf) < 0) {
+        fprintf(stderr, "kv: cannot open file %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = sbuf.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    // Keys and values are cut out in place, so map the file copy-on-write
+    // over an anonymous area one byte longer: a last line without a
+    // newline can then be terminated too.
+    char *map = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED ||
+        mmap(map, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        fprintf(stderr, "kv: cannot map file %s\n", path);
+        if (map != MAP_FAILED) {
+            munmap(map, size + 1);
+        }
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    int nchunks = store->threads;
+    if ((size_t)nchunks > size / TEXT_MIN_CHUNK + 1) {
+        nchunks = size / TEXT_MIN_CHUNK + 1;
+    }
+    text_chunk_t *chunks = (text_chunk_t *)calloc(nchunks, sizeof(text_chunk_t));
+    char *end = map + size;
+    char *prev = map;
+    for (int i = 0; i < nchunks; ++i) {
+        chunks[i].start = prev;
+        if (i == nchunks - 1) {
+            chunks[i].end = end;
+            break;
+        }
+        // Move the cut to just past a newline.
+        char *cut = map + size / nchunks * (i + 1);
+        cut = cut < prev ? prev : cut;
+        char *newline = memchr(cut, '\n', end - cut);
+        prev = newline != NULL ? newline + 1 : end;
+        chunks[i].end = prev;
+    }
+    run_workers(parse_chunk, chunks, sizeof(text_chunk_t), nchunks);
+
+    // Merge the sorted chunks; on equal keys the earlier chunk goes first.
+    size_t *next = (size_t *)calloc(nchunks, sizeof(size_t));
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < nchunks; ++i) {
+            if (next[i] < chunks[i].count &&
+                (best < 0 || strcmp(chunks[i].pairs[next[i]].key, chunks[best].pairs[next[best]].key) < 0)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        text_pair_t const *pair = &chunks[best].pairs[next[best]++];
+        db_put_hashed(store->db, pair->hash, pair->key, pair->value);
+    }
+    for (int i = 0; i < nchunks; ++i) {
+        free(chunks[i].pairs);
+    }
+    free(next);
+    free(chunks);
+    munmap(map, size + 1);
+    return true;
+}
+
+static void *format_slice(void *arg) {
+    text_slice_t *slice = (text_slice_t *)arg;
+    slice->len = 0;
+    for (size_t i = 0; i < slice->count; ++i) {
+        slice->len += strlen(slice->keys[i]) + strlen(slice->values[i]) + 2;
+    }
+    slice->buffer = (char *)malloc(slice->len + 1);
+    char *p = slice->buffer;
+    for (size_t i = 0; i < slice->count; ++i) {
+        size_t keyLength = strlen(slice->keys[i]);
+        size_t valueLength = strlen(slice->values[i]);
+        memcpy(p, slice->keys[i], keyLength);
+        p += keyLength;
+        *p++ = ',';
+        memcpy(p, slice->values[i], valueLength);
+        p += valueLength;
+        *p++ = '\n';
+    }
+    return NULL;
+}
+
+static void *write_slice(void *arg) {
+    text_slice_t *slice = (text_slice_t *)arg;
+    size_t done = 0;
+    slice->ok = true;
+    while (done < slice->len) {
+        ssize_t n = pwrite(slice->fd, slice->buffer + done, slice->len - done, slice->offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            slice->ok = false;
+            break;
+        }
+        done += n;
+    }
+    free(slice->buffer);
+    return NULL;
+}
+
+static bool write_text(store_t const *store, char const *path) {
+    size_t bound = db_size(store->db) + store->snapshot->count;
+    char const **keys = (char const **)malloc((bound + 1) * sizeof(char *));
+    char const **values = (char const **)malloc((bound + 1) * sizeof(char *));
+    size_t count = 0;
+    store_iter_t it = { 0, 0 };
+    while (store_next(store, &it, &keys[count], &values[count])) {
+        ++count;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "kv: cannot open file %s\n", path);
+        free(keys);
+        free(values);
+        return false;
+    }
+
+    int nslices = store->threads;
+    if ((size_t)nslices > count / TEXT_MIN_SLICE + 1) {
+        nslices = count / TEXT_MIN_SLICE + 1;
+    }
+    text_slice_t *slices = (text_slice_t *)calloc(nslices, sizeof(text_slice_t));
+    for (int i = 0; i < nslices; ++i) {
+        size_t first = count * i / nslices;
+        slices[i].keys = keys + first;
+        slices[i].values = values + first;
+        slices[i].count = count * (i + 1) / nslices - first;
+        slices[i].fd = fd;
+    }
+    run_workers(format_slice, slices, sizeof(text_slice_t), nslices);
+
+    off_t offset = 0;
+    for (int i = 0; i < nslices; ++i) {
+        slices[i].offset = offset;
+        offset += slices[i].len;
+    }
+    run_workers(write_slice, slices, sizeof(text_slice_t), nslices);
+
+    bool ok = true;
+    for (int i = 0; i < nslices; ++i) {
+        ok = ok && slices[i].ok;
+    }
+    if (close(fd) != 0 || !ok) {
+        fprintf(stderr, "kv: cannot write file %s\n", path);
+        ok = false;
+    }
+    free(slices);
+    free(keys);
+    free(values);
+    return ok;
+}
+
+//
+// Log: one command per line, in the same syntax as the command line
+// ("p,key,value", "d,key", "c"). Replaying it is idempotent, so a crash
+// between writing a new snapshot and truncating the log is harmless.
+//
+static bool replay_log(store_t *store, char const *path) {
+    FILE *f = fopen(path, "r");
+    store->log_bytes = 0;
+
+    if (f == NULL) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        fprintf(stderr, "kv: cannot open file %s\n", path);
+        return false;
+    }
+
+    char *buffer = NULL;
+    size_t bufferSize = 0;
+    ssize_t lineLength = 0;
+    bool torn = false;
+
+    while ((lineLength = getline(&buffer, &bufferSize, f)) > 0) {
+        if (buffer[lineLength - 1] != '\n') {
+            // Half-written record from a crash: drop it.
+            torn = true;
+            break;
+        }
+        store->log_bytes += lineLength;
+
+        char *line = buffer;
+        char *cmd = strsep(&line, ",\n");
+        if (cmd[0] == 'p') {
+            char *key = strsep(&line, ",");
+            char *value = strsep(&line, "\n");
+            apply_put(store, key, value);
+        } else if (cmd[0] == 'd') {
+            apply_delete(store, strsep(&line, "\n"));
+        } else if (cmd[0] == 'c') {
+            apply_clear(store);
+        }
+    }
+    free(buffer);
+    fclose(f);
+
+    // Cut the torn tail off so new records don't get glued onto it.
+    if (torn && truncate(path, store->log_bytes) != 0) {
+        fprintf(stderr, "kv: cannot truncate file %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Adds a record to the log, batch or not. Returns false if it can't.
+static bool write_record(store_t *store, char const *fmt, char const *key, char const *value) {
+    if (store->log == NULL) {
+        store->log = fopen(store->log_path, "a");
+        if (store->log == NULL) {
+            fprintf(stderr, "kv: cannot open file %s\n", store->log_path);
+            store->failed = true;
+            return false;
+        }
+    }
+
+    int written = fprintf(store->log, fmt, key, value);
+    if (written < 0) {
+        store->failed = true;
+        return false;
+    }
+    store->log_bytes += written;
+    return true;
+}
+
+static void append_record(store_t *store, char const *fmt, char const *key, char const *value) {
+    if (store->batching) {
+        store->batch_dirty = true;
+        return;
+    }
+    if (write_record(store, fmt, key, value) &&
+        store->log_bytes >= COMPACT_MIN_LOG_BYTES && store->log_bytes >= store->snapshot_bytes) {
+        store_compact(store);
+    }
+}
+
+store_t *store_open(char const *snapshot_path, char const *log_path, char const *text_path, int threads) {
+    store_t *store = (store_t *)calloc(1, sizeof(store_t));
+    store->threads = threads < 1 ? 1 : threads;
+    store->snapshot_path = snapshot_path;
+    store->log_path = log_path;
+
+    store->snapshot = snapshot_open(snapshot_path);
+    if (store->snapshot == NULL) {
+        free(store);
+        return NULL;
+    }
+    store->snapshot_bytes = store->snapshot->map_size;
+    store->db = db_create(true);
+
+    bool ok = true;
+    if (store->snapshot->map == NULL && text_path != NULL && access(text_path, F_OK) == 0) {
+        ok = read_text(store, text_path);
+        store->compact_on_close = true;
+    }
+    if (!ok || !replay_log(store, log_path)) {
+        db_destroy(store->db);
+        snapshot_close(store->snapshot);
+        free(store);
+        return NULL;
+    }
+    if (store->cleared) {
+        // A clear that a crash cut short: finish it.
+        store_compact(store);
+    }
+    return store;
+}
+
+bool store_close(store_t *store) {
+    if (store->compact_on_close) {
+        store_compact(store);
+    }
+    if (store->log != NULL && fclose(store->log) != 0) {
+        fprintf(stderr, "kv: cannot write file %s\n", store->log_path);
+        store->failed = true;
+    }
+
+    bool ok = !store->failed;
+    db_destroy(store->db);
+    snapshot_close(store->snapshot);
+    free(store);
+    return ok;
+}
+
+char const *store_get(store_t const *store, char const *key) {
+    entry_t const *entry = db_get(store->db, key);
+    if (entry != NULL) {
+        return entry->value;
+    }
+    return snapshot_get(store->snapshot, key);
+}
+
+void store_put(store_t *store, char const *key, char const *value) {
+    apply_put(store, key, value);
+    append_record(store, "p,%s,%s\n", key, value);
+}
+
+bool store_delete(store_t *store, char const *key) {
+    if (!apply_delete(store, key)) {
+        return false;
+    }
+    append_record(store, "d,%s\n", key, NULL);
+    return true;
+}
+
+void store_clear(store_t *store) {
+    // The clear is logged before the empty snapshot replaces the old one,
+    // so a crash in between can't bring the old keys back; the compaction
+    // then empties the log. That goes for a batch too: its log still has
+    // the records from before it.
+    apply_clear(store);
+    if (write_record(store, "c\n", NULL, NULL)) {
+        store_compact(store);
+    }
+}
+
+void store_all(store_t const *store, FILE *output) {
+    store_iter_t it = { 0, 0 };
+    char const *key, *value;
+    while (store_next(store, &it, &key, &value)) {
+        fprintf(output, "%s,%s\n", key, value);
+    }
+}
+
+void store_flush(store_t *store) {
+    if (store->log != NULL && fflush(store->log) != 0) {
+        store->failed = true;
+    }
+}
+
+void store_begin_batch(store_t *store) {
+    store->batching = true;
+}
+
+// Makes a rename to 'path' durable by syncing the directory it is in.
+static bool sync_dir(char const *path) {
+    char dir[4096];
+    char const *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+// The change table is exactly the difference between the snapshot and the
+// live view, so a log of its entries can replace the current log.
+static bool rewrite_log(store_t *store) {
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", store->log_path);
+    FILE *f = fopen(tmpPath, "w");
+    if (f == NULL) {
+        fprintf(stderr, "kv: cannot open file %s\n", tmpPath);
+        return false;
+    }
+
+    // Until a compaction replaces the old snapshot, the log has to say it
+    // is gone.
+    if (store->cleared) {
+        fprintf(f, "c\n");
+    }
+    size_t pos = 0;
+    entry_t const *entry;
+    while ((entry = db_next(store->db, &pos)) != NULL) {
+        if (entry->value != NULL) {
+            fprintf(f, "p,%s,%s\n", entry->key, entry->value);
+        } else {
+            fprintf(f, "d,%s\n", entry->key);
+        }
+    }
+    long bytes = ftell(f);
+    bool synced = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (ferror(f) || fclose(f) != 0 || !synced ||
+        rename(tmpPath, store->log_path) != 0 || !sync_dir(store->log_path)) {
+        fprintf(stderr, "kv: cannot write file %s\n", store->log_path);
+        return false;
+    }
+
+    if (store->log != NULL) {
+        fclose(store->log);
+        store->log = NULL;
+    }
+    store->log_bytes = bytes;
+    return true;
+}
+
+bool store_end_batch(store_t *store) {
+    store->batching = false;
+    if (!store->batch_dirty) {
+        return true;
+    }
+    store->batch_dirty = false;
+
+    long bytes = 0;
+    size_t pos = 0;
+    entry_t const *entry;
+    while ((entry = db_next(store->db, &pos)) != NULL) {
+        bytes += strlen(entry->key) + (entry->value != NULL ? strlen(entry->value) + 4 : 3);
+    }
+
+    bool ok = bytes >= COMPACT_MIN_LOG_BYTES && bytes >= store->snapshot_bytes
+        ? store_compact(store)
+        : rewrite_log(store);
+    if (!ok) {
+        store->failed = true;
+    }
+    return ok;
+}
+
+bool store_import(store_t *store, char const *path) {
+    // Persisted in one step, like a batch, unless already inside one.
+    bool nested = store->batching;
+    store_begin_batch(store);
+    bool ok = read_text(store, path);
+    store->batch_dirty = store->batch_dirty || ok;
+    if (nested) {
+        return ok;
+    }
+    return store_end_batch(store) && ok;
+}
+
+bool store_export(store_t const *store, char const *path) {
+    return write_text(store, path);
+}
+
+bool store_compact(store_t *store) {
+    if (store->log != NULL) {
+        // A clear record has to be on disk before the snapshot it empties.
+        bool synced = fflush(store->log) == 0 && fsync(fileno(store->log)) == 0;
+        fclose(store->log);
+        store->log = NULL;
+        if (!synced) {
+            fprintf(stderr, "kv: cannot write file %s\n", store->log_path);
+            store->failed = true;
+            return false;
+        }
+    }
+    store->compact_on_close = false;
+
+    size_t bound = db_size(store->db) + store->snapshot->count;
+    char const **keys = (char const **)malloc((bound + 1) * sizeof(char *));
+    char const **values = (char const **)malloc((bound + 1) * sizeof(char *));
+    size_t count = 0;
+    store_range_t range;
+    store_range(store, &range, NULL, NULL);
+    while (store_range_next(store, &range, &keys[count], &values[count])) {
+        ++count;
+    }
+
+    // Write next to the old snapshot and rename over it, so a crash leaves
+    // either the old or the new snapshot in place. Both the file and the
+    // rename are synced, which makes that hold across a power failure too.
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", store->snapshot_path);
+    long bytes = 0;
+    bool ok = snapshot_write(tmpPath, keys, values, count, &bytes);
+    free(keys);
+    free(values);
+    if (ok && (rename(tmpPath, store->snapshot_path) != 0 || !sync_dir(store->snapshot_path))) {
+        fprintf(stderr, "kv: cannot write file %s\n", store->snapshot_path);
+        ok = false;
+    }
+
+    snapshot_t *snapshot = ok ? snapshot_open(store->snapshot_path) : NULL;
+    if (snapshot == NULL) {
+        // The old mapping and the change table are still consistent.
+        store->failed = true;
+        return false;
+    }
+    snapshot_close(store->snapshot);
+    store->snapshot = snapshot;
+    store->snapshot_bytes = bytes;
+    store->cleared = false;
+    db_clear(store->db);
+
+    // The snapshot now has everything the log had.
+    store->log = fopen(store->log_path, "w");
+    if (store->log == NULL) {
+        fprintf(stderr, "kv: cannot open file %s\n", store->log_path);
+        store->failed = true;
+        return false;
+    }
+    store->log_bytes = 0;
+    return true;
+}
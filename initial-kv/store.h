@@ -0,0 +1,96 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "db.h"
+#include "snapshot.h"
+
+//
+// Persistence for kv: a read-only, mmap'ed binary snapshot of the whole
+// database plus an append-only log of the puts and deletes made since.
+// Opening maps the snapshot and replays only the log into an in-memory
+// table of changes, so startup cost doesn't grow with the database.
+// Updates only append a record. Once the log outgrows the snapshot the two
+// are folded into a fresh snapshot and the log starts over, so each update
+// costs O(1) I/O amortized.
+//
+
+typedef struct Store {
+    snapshot_t *snapshot;
+    db_t *db;               // changes since the snapshot; a NULL value
+                            // marks a snapshot key that has been deleted
+    char const *snapshot_path;
+    char const *log_path;
+    FILE *log;              // opened lazily on the first update
+    long snapshot_bytes;
+    long log_bytes;
+    bool compact_on_close;  // set after importing an old text database
+    bool batching;          // between store_begin_batch and store_end_batch
+    bool batch_dirty;       // updates made while batching
+    bool failed;            // sticky: some write to disk went wrong
+    bool cleared;           // the snapshot file is still the one from
+                            // before a clear, until the next compaction
+    int threads;            // workers for text import and export
+} store_t;
+
+// If there is no snapshot yet but 'text_path' exists (a database written
+// by an older kv), it is imported and turned into a snapshot on close.
+// Returns NULL (after printing an error) if an existing file can't be read.
+// Text imports and exports use up to 'threads' threads.
+store_t *store_open(char const *snapshot_path, char const *log_path, char const *text_path, int threads);
+// Flushes the log and frees the store. Returns false if any write to disk
+// failed while the store was open.
+bool store_close(store_t *store);
+
+// Returned value stays valid until the next update.
+char const *store_get(store_t const *store, char const *key);
+void store_put(store_t *store, char const *key, char const *value);
+// Returns false if the key was not present.
+bool store_delete(store_t *store, char const *key);
+void store_clear(store_t *store);
+// Prints "key,value" lines, in no particular order.
+void store_all(store_t const *store, FILE *output);
+
+typedef struct StoreIter {
+    size_t db_pos;
+    uint64_t snapshot_pos;
+} store_iter_t;
+
+// Visits every live pair, in no particular order; start with a zeroed
+// iterator. Returns false when done. The store must not be updated while
+// iterating.
+bool store_next(store_t const *store, store_iter_t *it, char const **key, char const **value);
+
+typedef struct StoreRange {
+    skipnode_t const *node;     // next change table entry
+    uint64_t snapshot_pos;      // next snapshot record, in key order
+    char const *end;            // inclusive upper bound, NULL for none
+} store_range_t;
+
+// Starts a scan over the live keys in [start, end], both inclusive and
+// either one NULL for no bound. Costs O(log n) to find the start.
+void store_range(store_t const *store, store_range_t *range, char const *start, char const *end);
+// Next pair of the scan, in strcmp order. Returns false when done. The
+// store must not be updated while scanning.
+bool store_range_next(store_t const *store, store_range_t *range, char const **key, char const **value);
+
+// Pushes buffered log records to the file.
+void store_flush(store_t *store);
+
+// Between these two calls updates are applied in memory only, and
+// store_end_batch persists all of them in one step: a rewritten log if the
+// changes are small next to the snapshot, a fresh snapshot otherwise.
+void store_begin_batch(store_t *store);
+bool store_end_batch(store_t *store);
+
+// Text import/export, one "key,value" line per entry. An import is
+// persisted in one step, like a batch.
+bool store_import(store_t *store, char const *path);
+bool store_export(store_t const *store, char const *path);
+
+// Writes a new snapshot and empties the log.
+bool store_compact(store_t *store);
+
+#endif // __STORE_H__
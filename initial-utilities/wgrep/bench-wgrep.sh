@@ -0,0 +1,78 @@
+#! /bin/bash
+
+# Usage: ./bench-wgrep.sh [megabytes] [wgrep binary ...]
+#
+# Generates a log file with tests/loggen.py (256 MB by default), and the
+# same lines split into 64 KB files, searches both for a few rare and
+# common patterns with each wgrep binary and with 'grep -F', and prints
+# the best of three runs in GB/s of input. Set KERNELS (e.g.
+# KERNELS="scalar sse2 avx2") to run each binary once per search kernel,
+# and THREADS (e.g. THREADS="1 2 4 8") once per number of threads.
+#
+# Then searches the large file for 24 alerting keywords, most of which
+# never match: with -f, with -c -f, once per keyword, and with
+# 'grep -F -f'.
+
+size=${1:-256}
+shift
+bins=${*:-./wgrep}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+python3 tests/loggen.py $size > $dir/log.in
+mkdir $dir/small
+(cd $dir/small && split -C 64k -a 5 ../log.in)
+printf '%s\n' segfault "correlation-id=7f3a9c0e" "took=4999ms" FATAL "panic:" "out of memory" \
+       "OOM killer" "stack trace" "deadlock detected" "connection refused" "disk full" \
+       "checksum mismatch" "assertion failed" "core dumped" "kernel BUG" Traceback \
+       NullPointerException "certificate expired" "permission denied" "no space left" \
+       "too many open files" "broken pipe" "data corruption" unreachable > $dir/keywords
+patterns=("segfault" "correlation-id=7f3a9c0e-5b21-4d8e-a6f4-c2b9e1d07a35" "took=4999ms" "ERROR" "INFO" "e")
+
+# bench name kernel threads input pattern command ...; the output goes to a
+# file, as grep stops at the first match when it writes to /dev/null
+bench () {
+    local name=$1 kernel=$2 threads=$3 input=$4 pattern=$5
+    shift 5
+    local bytes=$(stat -c %s $dir/log.in)
+    local best=
+    for run in 1 2 3; do
+        local start=$(date +%s.%N)
+        WGREP_KERNEL=$kernel WGREP_THREADS=$threads "$@" > $dir/out
+        local end=$(date +%s.%N)
+        best=$(awk -v s=$start -v e=$end -v b="$best" 'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+    done
+    local lines=$(wc -l < $dir/out)
+    printf "%-12s %-7s %-3s %-5s %-20.20s %9d lines  %7.3f s  %6.2f GB/s\n" "$name" ${kernel:-default} ${threads:--} \
+           $input "$pattern" $lines $best $(awk -v n=$bytes -v t=$best 'BEGIN { print n / t / 1e9 }')
+}
+
+for bin in $bins; do
+    if ! [[ -x $bin ]]; then
+        echo "$bin executable does not exist"
+        exit 1
+    fi
+    for kernel in ${KERNELS:-""}; do
+        for threads in ${THREADS:-""}; do
+            for pattern in "${patterns[@]}"; do
+                bench $bin "$kernel" "$threads" large "$pattern" $bin "$pattern" $dir/log.in
+                bench $bin "$kernel" "$threads" small "$pattern" $bin "$pattern" $dir/small/*
+            done
+        done
+    done
+done
+for pattern in "${patterns[@]}"; do
+    bench "grep -F" "" "" large "$pattern" grep -F -e "$pattern" $dir/log.in
+    bench "grep -F" "" "" small "$pattern" grep -h -F -e "$pattern" $dir/small/*
+done
+
+nkeywords=$(wc -l < $dir/keywords)
+for bin in $bins; do
+    for kernel in ${KERNELS:-""}; do
+        bench $bin "$kernel" "" large "-f $nkeywords keywords" $bin -f $dir/keywords $dir/log.in
+        bench $bin "$kernel" "" large "-c -f $nkeywords keywords" $bin -c -f $dir/keywords $dir/log.in
+        bench $bin "$kernel" "" large "$nkeywords runs" bash -c 'while read -r p; do "$0" "$p" "$1"; done < "$2"' \
+              $bin $dir/log.in $dir/keywords
+    done
+done
+bench "grep -F" "" "" large "-f $nkeywords keywords" grep -F -f $dir/keywords $dir/log.in
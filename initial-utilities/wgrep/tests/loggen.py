@@ -0,0 +1,41 @@
+#! /usr/bin/env python3
+
+# Usage: loggen.py [megabytes]
+#
+# Writes log-like lines (timestamp, level, component, a few words, some
+# numbers), 64 MB by default. About one line in 100000 contains
+# "segfault at 0000", and one in 50000 the long marker
+# "correlation-id=7f3a9c0e-5b21-4d8e-a6f4-c2b9e1d07a35".
+
+import random
+import sys
+
+size = int(float(sys.argv[1]) * 1024 * 1024) if len(sys.argv) > 1 else 64 * 1024 * 1024
+random.seed(17)
+levels = ['INFO'] * 12 + ['DEBUG'] * 6 + ['WARN'] * 2 + ['ERROR']
+components = ['http', 'db', 'cache', 'auth', 'worker', 'scheduler', 'queue']
+words = ('request handled in user session token refresh cache miss hit retry '
+         'connection pool timeout upstream downstream closed opened query '
+         'rows returned bytes sent received queued job finished started '
+         'heartbeat lease renewed expired shard rebalance').split()
+out = sys.stdout
+
+written = 0
+line_no = 0
+while written < size:
+    lines = []
+    for _ in range(10000):
+        line_no += 1
+        text = ' '.join(random.choice(words) for _ in range(random.randint(3, 12)))
+        if line_no % 100000 == 0:
+            text += ' segfault at 0000'
+        if line_no % 50000 == 25000:
+            text += ' correlation-id=7f3a9c0e-5b21-4d8e-a6f4-c2b9e1d07a35'
+        lines.append('2026-10-%02d %02d:%02d:%02d.%03d %-5s [%s-%d] %s id=%d took=%dms\n' % (
+            line_no // 10000000 % 28 + 1, line_no // 360000 % 24, line_no // 6000 % 60,
+            line_no // 100 % 60, line_no % 1000, random.choice(levels),
+            random.choice(components), random.randint(1, 32), text,
+            random.randint(1, 10 ** 9), random.randint(0, 5000)))
+    block = ''.join(lines)
+    out.write(block[:size - written])
+    written += len(block)
@@ -1,63 +1,978 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
 
-bool containsLine(char *buffer, char *searchTerm)
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef struct Searcher
+{
+    char const *needle;
+    size_t length;
+    bool matchesNothing;
+    struct Automaton *automaton;    // set for -f: all patterns at once
+} searcher_t;
+
+// The filter below gives up when more than one candidate per this many
+// bytes turns out not to match.
+#define FILTER_MISS_RATE 8
+
+// The fallback: glibc's memmem() switches to the Two-Way algorithm when
+// its own shifts stop paying off, which keeps it linear for any needle.
+static char const *find_two_way(searcher_t const *s, char const *hay, size_t n)
+{
+    return memmem(hay, n, s->needle, s->length);
+}
+
+//
+// Kernels for needles of at least 2 bytes. The vector ones compare a block
+// of candidate positions against the needle's first byte, and the block
+// 'length - 1' further on against its last byte, and only check the rest
+// of the needle where both match. That is far faster than shift-based
+// searches on text, but needles like "aaaaba" in "aaaaaa..." make every
+// position a candidate, so past too many misses they hand the rest over
+// to find_two_way(). Each returns the first match in [hay, hay + n), or
+// NULL.
+//
+typedef char const *(*find_fn)(searcher_t const *s, char const *hay, size_t n);
+
+static char const *find_scalar(searcher_t const *s, char const *hay, size_t n)
 {
-    int startIdx = 0;
-    while (buffer[startIdx] != 0)
+    if (n < s->length)
+        return NULL;
+    char const *end = hay + n - s->length + 1;
+    char const *p = hay;
+    size_t misses = 0;
+    while (p < end && (p = memchr(p, s->needle[0], end - p)) != NULL)
     {
-        int curIdx = 0;
-        while (buffer[startIdx + curIdx] != 0 && (buffer[startIdx + curIdx] == searchTerm[curIdx]) && searchTerm[curIdx] != 0)
-            ++curIdx;
+        if (memcmp(p + 1, s->needle + 1, s->length - 1) == 0)
+            return p;
+        ++p;
+        if (++misses > 64 + (p - hay) / FILTER_MISS_RATE)
+            return find_two_way(s, p, hay + n - p);
+    }
+    return NULL;
+}
 
-        if (searchTerm[curIdx] == 0)
+#if defined(__x86_64__)
+static char const *find_sse2(searcher_t const *s, char const *hay, size_t n)
+{
+    size_t m = s->length;
+    __m128i first = _mm_set1_epi8(s->needle[0]);
+    __m128i last = _mm_set1_epi8(s->needle[m - 1]);
+    size_t i = 0;
+    size_t misses = 0;
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((__m128i const *)(hay + i));
+        __m128i b = _mm_loadu_si128((__m128i const *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0)
         {
-            return true;
+            size_t k = i + __builtin_ctz(mask);
+            if (memcmp(hay + k + 1, s->needle + 1, m - 2) == 0)
+                return hay + k;
+            mask &= mask - 1;
+            ++misses;
         }
-        ++startIdx;
+        if (misses > 64 + i / FILTER_MISS_RATE)
+            return find_two_way(s, hay + i, n - i);
     }
-    return false;
+    return find_scalar(s, hay + i, n - i);
 }
 
-int main(int argc, char *argv[])
+__attribute__((target("avx2")))
+static char const *find_avx2(searcher_t const *s, char const *hay, size_t n)
 {
-    if (argc == 1)
+    size_t m = s->length;
+    __m256i first = _mm256_set1_epi8(s->needle[0]);
+    __m256i last = _mm256_set1_epi8(s->needle[m - 1]);
+    size_t i = 0;
+    size_t misses = 0;
+    for (; i + m - 1 + 32 <= n; i += 32)
     {
-        printf("wgrep: searchterm [file ...]\n");
+        __m256i a = _mm256_loadu_si256((__m256i const *)(hay + i));
+        __m256i b = _mm256_loadu_si256((__m256i const *)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0)
+        {
+            size_t k = i + __builtin_ctz(mask);
+            if (memcmp(hay + k + 1, s->needle + 1, m - 2) == 0)
+                return hay + k;
+            mask &= mask - 1;
+            ++misses;
+        }
+        if (misses > 64 + i / FILTER_MISS_RATE)
+            return find_two_way(s, hay + i, n - i);
+    }
+    return find_sse2(s, hay + i, n - i);
+}
+#endif
+
+// Picked once at startup: the widest kernel the CPU supports, unless
+// WGREP_KERNEL names another one (scalar, sse2, avx2), which is how the
+// tests compare them.
+static find_fn find_short = find_scalar;
+
+static void choose_kernel()
+{
+    char const *name = getenv("WGREP_KERNEL");
+    name = name != NULL ? name : "";
+    if (strcmp(name, "scalar") == 0)
+        return;
+#if defined(__x86_64__)
+    if (strcmp(name, "sse2") == 0 || !__builtin_cpu_supports("avx2"))
+        find_short = find_sse2;
+    else
+        find_short = find_avx2;
+#endif
+}
+
+//
+// Multi-pattern search (-f): an Aho-Corasick automaton over all patterns,
+// run as a DFA so that every input byte costs one table lookup. Bytes that
+// no pattern uses share a column of the table, which keeps it to
+// 'states x (distinct pattern bytes + 1)' entries. A transition into a
+// state where some pattern ends is stored negated, so the scan loop needs
+// a single test per byte.
+//
+#define TEDDY_MAX_PATTERNS 64
+#define TEDDY_BUCKETS 8
+
+typedef struct Automaton
+{
+    unsigned char classOf[256];
+    size_t nclasses;
+    int32_t *next;          // per state and class: state * nclasses, or ~that
+    int32_t *out;           // per state: a pattern ending there, or -1
+    int32_t *dictLink;      // per state: the longest suffix state with an out
+    int32_t *sameText;      // per pattern: the next one with the same text
+    char **patterns;
+    size_t npatterns;
+    size_t *lengths;
+    bool hasEmpty;          // an empty pattern matches every line
+    size_t *counts;         // per pattern: lines it was found on (for -c)
+
+    // Teddy prefilter (AVX2 only, up to TEDDY_MAX_PATTERNS): patterns are
+    // spread over 8 buckets, and for each of the first 'teddyWidth' bytes
+    // of a pattern, the bucket's bit is set in the entries for that byte's
+    // low and high nibble. A pshufb per nibble then yields, for 32
+    // positions at once, the buckets that may start there.
+    size_t teddyWidth;      // 0 if not used
+    uint8_t teddyLo[3][16];
+    uint8_t teddyHi[3][16];
+    int32_t teddyBucket[TEDDY_BUCKETS][TEDDY_MAX_PATTERNS / TEDDY_BUCKETS];
+    size_t teddyBucketSize[TEDDY_BUCKETS];
+} automaton_t;
+
+static void *checked_alloc(size_t n)
+{
+    void *p = calloc(n, 1);
+    if (p == NULL)
+    {
+        printf("wgrep: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static automaton_t *automaton_build(char **patterns, size_t npatterns)
+{
+    automaton_t *a = checked_alloc(sizeof(automaton_t));
+    a->patterns = patterns;
+    a->npatterns = npatterns;
+
+    bool used[256] = { false };
+    size_t total = 1;
+    for (size_t i = 0; i < npatterns; ++i)
+    {
+        for (unsigned char const *c = (unsigned char const *)patterns[i]; *c != 0; ++c)
+            used[*c] = true;
+        total += strlen(patterns[i]);
+        a->hasEmpty |= patterns[i][0] == 0;
+    }
+    a->nclasses = 1;
+    for (int c = 0; c < 256; ++c)
+        a->classOf[c] = used[c] ? a->nclasses++ : 0;
+    if (total * a->nclasses > INT32_MAX)
+    {
+        printf("wgrep: too many patterns\n");
+        exit(1);
+    }
+
+    // The trie first, with -1 for missing edges.
+    size_t k = a->nclasses;
+    int32_t *go = checked_alloc(total * k * sizeof(int32_t));
+    memset(go, 0xff, total * k * sizeof(int32_t));
+    a->out = checked_alloc(total * sizeof(int32_t));
+    memset(a->out, 0xff, total * sizeof(int32_t));
+    a->dictLink = checked_alloc(total * sizeof(int32_t));
+    a->sameText = checked_alloc(npatterns * sizeof(int32_t));
+    size_t nstates = 1;
+    for (size_t i = 0; i < npatterns; ++i)
+    {
+        size_t state = 0;
+        for (unsigned char const *c = (unsigned char const *)patterns[i]; *c != 0; ++c)
+        {
+            int32_t *edge = &go[state * k + a->classOf[*c]];
+            if (*edge < 0)
+                *edge = nstates++;
+            state = *edge;
+        }
+        // Empty patterns are handled apart, or every state would match.
+        a->sameText[i] = state != 0 ? a->out[state] : -1;
+        if (state != 0)
+            a->out[state] = i;
+    }
+
+    // Then the failure links, breadth first, filling in the missing edges
+    // from the failure state's (already complete) row.
+    int32_t *fail = checked_alloc(nstates * sizeof(int32_t));
+    int32_t *queue = checked_alloc(nstates * sizeof(int32_t));
+    size_t head = 0, tail = 0;
+    a->dictLink[0] = -1;
+    for (size_t c = 0; c < k; ++c)
+    {
+        if (go[c] < 0)
+        {
+            go[c] = 0;
+        }
+        else
+        {
+            fail[go[c]] = 0;
+            a->dictLink[go[c]] = -1;
+            queue[tail++] = go[c];
+        }
+    }
+    while (head < tail)
+    {
+        int32_t u = queue[head++];
+        for (size_t c = 0; c < k; ++c)
+        {
+            int32_t v = go[u * k + c];
+            if (v < 0)
+            {
+                go[u * k + c] = go[fail[u] * k + c];
+                continue;
+            }
+            int32_t f = go[fail[u] * k + c];
+            fail[v] = f;
+            a->dictLink[v] = a->out[f] >= 0 ? f : a->dictLink[f];
+            queue[tail++] = v;
+        }
+    }
+
+    a->next = checked_alloc(nstates * k * sizeof(int32_t));
+    for (size_t i = 0; i < nstates * k; ++i)
+    {
+        int32_t v = go[i];
+        bool accepting = a->out[v] >= 0 || a->dictLink[v] >= 0;
+        a->next[i] = accepting ? ~(int32_t)(v * k) : (int32_t)(v * k);
+    }
+    free(go);
+    free(fail);
+    free(queue);
+
+    size_t shortest = SIZE_MAX;
+    a->lengths = checked_alloc((npatterns + 1) * sizeof(size_t));
+    for (size_t i = 0; i < npatterns; ++i)
+    {
+        a->lengths[i] = strlen(patterns[i]);
+        shortest = a->lengths[i] < shortest ? a->lengths[i] : shortest;
+    }
+#if defined(__x86_64__)
+    if (find_short == find_avx2 && !a->hasEmpty && npatterns <= TEDDY_MAX_PATTERNS)
+    {
+        // Patterns that sort next to each other share a bucket: similar
+        // prefixes add fewer nibbles to it, and so fewer false candidates.
+        int32_t order[TEDDY_MAX_PATTERNS];
+        for (size_t i = 0; i < npatterns; ++i)
+        {
+            size_t j = i;
+            for (; j > 0 && strcmp(patterns[order[j - 1]], patterns[i]) > 0; --j)
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+        a->teddyWidth = shortest < 3 ? shortest : 3;
+        for (size_t r = 0; r < npatterns; ++r)
+        {
+            size_t i = order[r];
+            size_t b = r * TEDDY_BUCKETS / npatterns;
+            a->teddyBucket[b][a->teddyBucketSize[b]++] = i;
+            for (size_t j = 0; j < a->teddyWidth; ++j)
+            {
+                unsigned char c = patterns[i][j];
+                a->teddyLo[j][c & 15] |= 1 << b;
+                a->teddyHi[j][c >> 4] |= 1 << b;
+            }
+        }
+    }
+#endif
+    return a;
+}
+
+// The last byte of the first match of any pattern to end in
+// [hay, hay + n), or NULL.
+static char const *automaton_run(automaton_t const *a, char const *hay, size_t n)
+{
+    unsigned char const *p = (unsigned char const *)hay;
+    unsigned char const *end = p + n;
+    int32_t const *next = a->next;
+    unsigned char const *classOf = a->classOf;
+    int32_t state = 0;
+    for (; p < end; ++p)
+    {
+        state = next[state + classOf[*p]];
+        if (state < 0)
+            return (char const *)p;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+// The start of the first match of any pattern in [hay, hay + n), or NULL.
+// Like the single-needle kernels, it leaves the rest to the automaton
+// once too many candidates turn out not to match.
+__attribute__((target("avx2")))
+static char const *teddy_search(automaton_t const *a, char const *hay, size_t n)
+{
+    size_t w = a->teddyWidth;
+    __m256i lo[3], hi[3];
+    for (size_t j = 0; j < w; ++j)
+    {
+        lo[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)a->teddyLo[j]));
+        hi[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)a->teddyHi[j]));
+    }
+    __m256i low = _mm256_set1_epi8(15);
+    size_t i = 0;
+    size_t misses = 0;
+    for (; i + 32 + w - 1 <= n; i += 32)
+    {
+        __m256i buckets = _mm256_set1_epi8(-1);
+        for (size_t j = 0; j < w; ++j)
+        {
+            __m256i block = _mm256_loadu_si256((__m256i const *)(hay + i + j));
+            __m256i l = _mm256_shuffle_epi8(lo[j], _mm256_and_si256(block, low));
+            __m256i h = _mm256_shuffle_epi8(hi[j], _mm256_and_si256(_mm256_srli_epi16(block, 4), low));
+            buckets = _mm256_and_si256(buckets, _mm256_and_si256(l, h));
+        }
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(buckets, _mm256_setzero_si256()));
+        if (mask == 0)
+            continue;
+        uint8_t candidates[32];
+        _mm256_storeu_si256((__m256i *)candidates, buckets);
+        while (mask != 0)
+        {
+            size_t k = __builtin_ctz(mask);
+            mask &= mask - 1;
+            for (unsigned bits = candidates[k]; bits != 0; bits &= bits - 1)
+            {
+                size_t b = __builtin_ctz(bits);
+                for (size_t t = 0; t < a->teddyBucketSize[b]; ++t)
+                {
+                    int32_t id = a->teddyBucket[b][t];
+                    if (i + k + a->lengths[id] <= n && memcmp(hay + i + k, a->patterns[id], a->lengths[id]) == 0)
+                        return hay + i + k;
+                }
+            }
+            ++misses;
+        }
+        if (misses > 64 + i / FILTER_MISS_RATE)
+            break;
+    }
+    return automaton_run(a, hay + i, n - i);
+}
+#endif
+
+// A pointer into the first match of any pattern in [hay, hay + n), or
+// NULL.
+static char const *automaton_search(automaton_t const *a, char const *hay, size_t n)
+{
+    if (a->hasEmpty)
+        return hay;
+#if defined(__x86_64__)
+    if (a->teddyWidth > 0)
+        return teddy_search(a, hay, n);
+#endif
+    return automaton_run(a, hay, n);
+}
+
+static void count_pattern(automaton_t *a, int32_t id, int32_t *seen, size_t *nseen)
+{
+    for (; id >= 0; id = a->sameText[id])
+    {
+        size_t i = 0;
+        while (i < *nseen && seen[i] != id)
+            ++i;
+        if (i < *nseen)
+            continue;
+        if (*nseen < 64)
+            seen[(*nseen)++] = id;
+        __atomic_fetch_add(&a->counts[id], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Adds one to the count of every pattern found on the line; the workers
+// of the parallel mode share the counts.
+static void automaton_count_line(automaton_t *a, char const *line, size_t n)
+{
+    // Patterns already counted for this line; past 64 of them a pattern
+    // found twice may be counted twice, which no real pattern list gets
+    // near.
+    int32_t seen[64];
+    size_t nseen = 0;
+    int32_t state = 0;
+    size_t k = a->nclasses;
+    for (size_t i = 0; i < a->npatterns && a->hasEmpty; ++i)
+    {
+        if (a->patterns[i][0] == 0)
+            __atomic_fetch_add(&a->counts[i], 1, __ATOMIC_RELAXED);
+    }
+    for (unsigned char const *p = (unsigned char const *)line; p < (unsigned char const *)line + n; ++p)
+    {
+        state = a->next[state + a->classOf[*p]];
+        if (state >= 0)
+            continue;
+        state = ~state;
+        for (int32_t t = state / k; t >= 0; t = a->dictLink[t])
+            count_pattern(a, a->out[t], seen, &nseen);
+    }
+}
+
+static void searcher_init(searcher_t *s, char const *needle)
+{
+    s->needle = needle;
+    s->length = strlen(needle);
+    // A line holds at most one newline, at its end, so a needle with one
+    // anywhere else is never found on a line.
+    s->matchesNothing = s->length > 1 && memchr(needle, '\n', s->length - 1) != NULL;
+    s->automaton = NULL;
+}
+
+// First occurrence of the needle in [hay, hay + n), or NULL. With -f, a
+// pointer into the first match instead.
+static char const *search(searcher_t const *s, char const *hay, size_t n)
+{
+    if (s->automaton != NULL)
+        return automaton_search(s->automaton, hay, n);
+    if (s->length == 0)
+        return hay;
+    if (n < s->length)
+        return NULL;
+    if (s->length == 1)
+        return memchr(hay, s->needle[0], n);
+    return find_short(s, hay, n);
+}
+
+// Where matching lines go: stdout, or, for the parallel mode, a buffer that
+// is written out once the chunks before it are.
+typedef struct Sink
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} sink_t;
+
+static void sink_append(sink_t *sink, char const *data, size_t n)
+{
+    if (sink->length + n > sink->capacity)
+    {
+        sink->capacity = sink->capacity * 2 > sink->length + n ? sink->capacity * 2 : sink->length + n;
+        sink->data = realloc(sink->data, sink->capacity);
+        if (sink->data == NULL)
+        {
+            printf("wgrep: out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(sink->data + sink->length, data, n);
+    sink->length += n;
+}
+
+// Lines that match are usually next to each other in the buffer when the
+// pattern is common, so they are collected into one span and written
+// together.
+typedef struct Output
+{
+    char const *start;
+    char const *end;
+    sink_t *sink;           // NULL for stdout
+} output_t;
+
+static void output_flush(output_t *out)
+{
+    if (out->end != out->start && out->sink != NULL)
+        sink_append(out->sink, out->start, out->end - out->start);
+    else if (out->end != out->start)
+        fwrite(out->start, 1, out->end - out->start, stdout);
+    out->start = out->end = NULL;
+}
+
+static void output_line(output_t *out, char const *start, char const *end)
+{
+    if (start != out->end)
+    {
+        output_flush(out);
+        out->start = start;
+    }
+    out->end = end;
+}
+
+//
+// Prints every line of [buffer, buffer + n) that contains the needle. The
+// whole buffer is searched at once, and the enclosing line is only looked
+// up around a match, so the text between matches is never split into
+// lines. Unless 'final' is set, the buffer may end in the middle of a line;
+// that line is left alone and the number of bytes before it is returned,
+// for the caller to search again once the rest has been read.
+//
+static size_t grep_buffer(searcher_t const *s, char const *buffer, size_t n, bool final, sink_t *sink)
+{
+    char const *end = buffer + n;
+    char const *p = buffer;
+    output_t out = { NULL, NULL, sink };
+    char const *match;
+    if (s->matchesNothing)
+        return n;
+    while (p < end && (match = search(s, p, end - p)) != NULL)
+    {
+        char const *lineStart = memrchr(p, '\n', match - p);
+        lineStart = lineStart != NULL ? lineStart + 1 : p;
+        char const *lineEnd = memchr(match, '\n', end - match);
+        if (lineEnd == NULL && !final)
+        {
+            output_flush(&out);
+            return lineStart - buffer;
+        }
+        lineEnd = lineEnd != NULL ? lineEnd + 1 : end;
+        if (s->automaton != NULL && s->automaton->counts != NULL)
+            automaton_count_line(s->automaton, lineStart, lineEnd - lineStart);
+        else
+            output_line(&out, lineStart, lineEnd);
+        p = lineEnd;
+    }
+    output_flush(&out);
+    if (final || p >= end)
+        return n;
+    char const *lastNewline = memrchr(p, '\n', end - p);
+    return lastNewline != NULL ? lastNewline + 1 - buffer : p - buffer;
+}
+
+// Pipes, terminals and anything else that cannot be mapped are read in
+// blocks of at least this size; a line longer than the buffer grows it.
+#define READ_BLOCK (1 << 20)
+
+static void grep_stream(searcher_t const *s, int fd, char **buffer, size_t *capacity)
+{
+    size_t have = 0;
+    for (;;)
+    {
+        if (have == *capacity)
+        {
+            *capacity = *capacity != 0 ? *capacity * 2 : READ_BLOCK;
+            *buffer = realloc(*buffer, *capacity);
+            if (*buffer == NULL)
+            {
+                printf("wgrep: out of memory\n");
+                exit(1);
+            }
+        }
+        ssize_t r = read(fd, *buffer + have, *capacity - have);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            grep_buffer(s, *buffer, have, true, NULL);
+            return;
+        }
+        have += r;
+        size_t done = grep_buffer(s, *buffer, have, false, NULL);
+        memmove(*buffer, *buffer + done, have - done);
+        have -= done;
+    }
+}
+
+static void grep_fd(searcher_t const *s, int fd, char **buffer, size_t *capacity)
+{
+    // Small files are cheaper to read than to map.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= READ_BLOCK)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            grep_buffer(s, map, st.st_size, true, NULL);
+            munmap(map, st.st_size);
+            return;
+        }
+    }
+    grep_stream(s, fd, buffer, capacity);
+}
+
+//
+// Parallel mode. The files are cut into tasks up front: a regular file
+// into chunks of WGREP_CHUNK bytes (one task if it is smaller), anything
+// else, like a pipe, into a single task that the writer reads itself when
+// it gets there. A pool of workers takes the chunks in order and collects
+// each one's matching lines in a buffer of its own; the main thread writes
+// the buffers out in order, so the output is the same as from the serial
+// loop. WGREP_THREADS sets the number of workers (one per CPU by default;
+// a single one means the serial loop). Needs -pthread on older glibc.
+//
+#define DEFAULT_CHUNK (16 * 1024 * 1024)
+// Chunks that may be searched ahead of the writer, per worker; bounds how
+// much output sits in memory.
+#define CHUNKS_AHEAD 4
+
+typedef struct Task
+{
+    char const *path;
+    off_t fileSize;
+    off_t offset;           // this chunk's bytes: [offset, offset + length)
+    off_t length;
+    bool stream;            // not a regular file: left to the writer
+    bool failed;            // the file could not be opened
+    bool done;
+    sink_t out;
+} task_t;
+
+typedef struct Pool
+{
+    searcher_t const *searcher;
+    task_t *tasks;
+    size_t ntasks;
+    size_t next;            // next task to hand to a worker
+    size_t written;         // tasks the writer is done with
+    size_t ahead;           // how far 'next' may run ahead of 'written'
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // a task became available to workers
+    pthread_cond_t done;    // a task was finished
+} pool_t;
+
+//
+// A chunk holds the lines that start inside it, so it begins after the
+// first newline at or past 'offset - 1' and ends after the first one at
+// or past its last byte. Only the lines that cross its edges are looked at
+// beyond them, and a chunk in the middle of one long line is empty.
+//
+static void grep_chunk(searcher_t const *s, task_t *task, int fd, char **buffer, size_t *capacity)
+{
+    char const *data;
+    void *map = NULL;
+    if (task->fileSize < READ_BLOCK)
+    {
+        // Small files are cheaper to read than to map.
+        if ((size_t)task->fileSize > *capacity)
+        {
+            *capacity = READ_BLOCK;
+            *buffer = realloc(*buffer, *capacity);
+            if (*buffer == NULL)
+            {
+                printf("wgrep: out of memory\n");
+                exit(1);
+            }
+        }
+        ssize_t r = pread(fd, *buffer, task->fileSize, 0);
+        task->fileSize = r > 0 ? r : 0;
+        data = *buffer;
+    }
+    else
+    {
+        map = mmap(NULL, task->fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            task->failed = true;
+            return;
+        }
+        data = map;
+    }
+
+    char const *end = data + task->fileSize;
+    char const *chunkEnd = data + task->offset + task->length;
+    char const *start = data;
+    if (task->offset > 0)
+    {
+        start = memchr(data + task->offset - 1, '\n', task->length);
+        start = start != NULL ? start + 1 : chunkEnd;
+    }
+    if (start < chunkEnd && start < end)
+    {
+        char const *stop = chunkEnd < end ? memchr(chunkEnd - 1, '\n', end - chunkEnd + 1) : NULL;
+        stop = stop != NULL ? stop + 1 : end;
+        grep_buffer(s, start, stop - start, true, &task->out);
+    }
+    if (map != NULL)
+        munmap(map, task->fileSize);
+}
+
+static void *worker(void *arg)
+{
+    pool_t *pool = arg;
+    char *buffer = NULL;
+    size_t capacity = 0;
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->ntasks && pool->next >= pool->written + pool->ahead)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->next == pool->ntasks)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            free(buffer);
+            return NULL;
+        }
+        task_t *task = &pool->tasks[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!task->stream && !task->failed)
+        {
+            int fd = open(task->path, O_RDONLY);
+            if (fd < 0)
+            {
+                task->failed = true;
+            }
+            else
+            {
+                if (task->fileSize > 0)
+                    grep_chunk(pool->searcher, task, fd, &buffer, &capacity);
+                close(fd);
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = true;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static size_t env_size(char const *name, size_t fallback)
+{
+    char const *value = getenv(name);
+    long n = value != NULL ? atol(value) : 0;
+    return n > 0 ? (size_t)n : fallback;
+}
+
+// Returns the exit status, like main().
+static int grep_parallel(searcher_t const *searcher, char **paths, int npaths, size_t nthreads)
+{
+    size_t chunkSize = env_size("WGREP_CHUNK", DEFAULT_CHUNK);
+    size_t ntasks = 0;
+    size_t capacity = npaths;
+    task_t *tasks = malloc(capacity * sizeof(task_t));
+    for (int i = 0; i < npaths && tasks != NULL; ++i)
+    {
+        struct stat st;
+        task_t task = { paths[i], 0, 0, 0, false, false, false, { NULL, 0, 0 } };
+        if (stat(paths[i], &st) != 0)
+            task.failed = true;
+        else if (!S_ISREG(st.st_mode))
+            task.stream = true;
+        else
+            task.fileSize = st.st_size;
+
+        // At least one task per file, so that an empty one still gets
+        // opened.
+        off_t offset = 0;
+        do
+        {
+            if (ntasks == capacity)
+            {
+                capacity *= 2;
+                tasks = realloc(tasks, capacity * sizeof(task_t));
+                if (tasks == NULL)
+                    break;
+            }
+            task.offset = offset;
+            task.length = task.fileSize - offset < (off_t)chunkSize ? task.fileSize - offset : (off_t)chunkSize;
+            tasks[ntasks++] = task;
+            offset += task.length;
+        } while (offset < task.fileSize);
+
+        // Nothing after a file that is not there gets searched.
+        if (task.failed)
+            break;
+    }
+    if (tasks == NULL)
+    {
+        printf("wgrep: out of memory\n");
         return 1;
     }
 
-    char *searchTerm = argv[1];
+    pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.searcher = searcher;
+    pool.tasks = tasks;
+    pool.ntasks = ntasks;
+    pool.ahead = nthreads * CHUNKS_AHEAD;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (size_t i = 0; i < nthreads; ++i)
+        pthread_create(&threads[i], NULL, worker, &pool);
+
     char *buffer = NULL;
     size_t bufferCapacity = 0;
+    int status = 0;
+    for (size_t i = 0; i < ntasks && status == 0; ++i)
+    {
+        task_t *task = &tasks[i];
+        pthread_mutex_lock(&pool.lock);
+        while (!task->done)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        int fd = -1;
+        if (task->stream && (fd = open(task->path, O_RDONLY)) >= 0)
+        {
+            grep_fd(searcher, fd, &buffer, &bufferCapacity);
+            close(fd);
+        }
+        if (task->failed || (task->stream && fd < 0))
+        {
+            printf("wgrep: cannot open file\n");
+            status = 1;
+        }
+        fwrite(task->out.data, 1, task->out.length, stdout);
+        free(task->out.data);
 
-    for (int i = 1; i < argc; ++i)
+        pthread_mutex_lock(&pool.lock);
+        pool.written++;
+        pthread_cond_broadcast(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    if (status != 0)
+    {
+        // The workers may still be busy with chunks that will never be
+        // written.
+        fflush(stdout);
+        _exit(status);
+    }
+
+    for (size_t i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(tasks);
+    free(buffer);
+    return 0;
+}
+
+// One pattern per line of the file; NULL if it cannot be read.
+static char **read_patterns(char const *path, size_t *npatterns)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    char **patterns = NULL;
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    *npatterns = 0;
+    while ((length = getline(&line, &lineCapacity, f)) > 0)
     {
-        FILE *f = NULL;
-        if (argc == 2)
+        if (line[length - 1] == '\n')
+            line[length - 1] = 0;
+        if (*npatterns == capacity)
         {
-            f = stdin;
+            capacity = capacity != 0 ? capacity * 2 : 16;
+            patterns = realloc(patterns, capacity * sizeof(char *));
         }
-        else
+        if (patterns == NULL || (patterns[*npatterns] = strdup(line)) == NULL)
         {
-            if (i == 1)
-                continue;
-            f = fopen(argv[i], "r");
+            printf("wgrep: out of memory\n");
+            exit(1);
         }
+        ++*npatterns;
+    }
+    free(line);
+    fclose(f);
+    return patterns;
+}
 
-        if (f == NULL)
+int main(int argc, char *argv[])
+{
+    // 'wgrep [-c] -f patternfile [file ...]' searches for every line of
+    // patternfile at once; with -c it prints how many lines each pattern
+    // was found on instead of the lines. Anything else is a search term,
+    // "-c" included.
+    bool countOnly = argc > 2 && strcmp(argv[1], "-c") == 0 && strcmp(argv[2], "-f") == 0;
+    bool patternFile = argc > 2 && strcmp(argv[countOnly ? 2 : 1], "-f") == 0;
+    int first = patternFile ? (countOnly ? 4 : 3) : 2;
+    if (argc == 1 || argc < first)
+    {
+        printf("wgrep: searchterm [file ...]\n");
+        return 1;
+    }
+    choose_kernel();
+
+    searcher_t searcher;
+    searcher_init(&searcher, patternFile ? "" : argv[1]);
+    if (patternFile)
+    {
+        size_t npatterns = 0;
+        char **patterns = read_patterns(argv[first - 1], &npatterns);
+        if (patterns == NULL)
         {
             printf("wgrep: cannot open file\n");
             return 1;
         }
-        while (getline(&buffer, &bufferCapacity, f) > 0)
+        searcher.automaton = automaton_build(patterns, npatterns);
+        if (countOnly)
+            searcher.automaton->counts = checked_alloc((npatterns + 1) * sizeof(size_t));
+    }
+
+    size_t nthreads = env_size("WGREP_THREADS", get_nprocs());
+    if (argc > first && nthreads > 1)
+    {
+        int status = grep_parallel(&searcher, argv + first, argc - first, nthreads);
+        if (status != 0)
+            return status;
+    }
+    else
+    {
+        char *buffer = NULL;
+        size_t bufferCapacity = 0;
+        for (int i = first - 1; i < argc; ++i)
         {
-            if (containsLine(buffer, searchTerm))
+            int fd = -1;
+            if (argc == first)
+            {
+                fd = STDIN_FILENO;
+            }
+            else
             {
-                printf("%s", buffer);
+                if (i == first - 1)
+                    continue;
+                fd = open(argv[i], O_RDONLY);
             }
+
+            if (fd < 0)
+            {
+                printf("wgrep: cannot open file\n");
+                return 1;
+            }
+            grep_fd(&searcher, fd, &buffer, &bufferCapacity);
+            if (fd != STDIN_FILENO)
+                close(fd);
         }
     }
 
+    automaton_t const *a = searcher.automaton;
+    for (size_t i = 0; a != NULL && a->counts != NULL && i < a->npatterns; ++i)
+        printf("%zu %s\n", a->counts[i], a->patterns[i]);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,28 +1,773 @@
-#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define RECORD_SIZE 5
+// Compressed input is read this many records at a time.
+#define READ_RECORDS (256 * 1024)
+// Runs are expanded here and handed to write() in one go.
+#define OUT_BUFFER (1024 * 1024)
+// Long runs go out as this many copies of a full buffer per writev().
+#define REPEAT_IOVS 16
+// Decoding in parallel is only worth it past this much input, unless
+// WUNZIP_THREADS asks for it.
+#define PARALLEL_MIN (1024 * 1024)
+// Most records a parallel worker takes at once.
+#define PIECE_RECORDS (1024 * 1024)
+
+//
+// Framed format, as written by wzip -b and pzip -b. It starts with a
+// 16-byte header:
+//
+//   "\0\0\0\0WZF1"   magic; as a plain record it would be a count of 0,
+//                    which wzip never writes
+//   u32              nominal block size (0 if it doesn't fit)
+//   u32              0, reserved
+//
+// then the blocks: plain records that each expand to one block of the
+// input (at most the block size, and never spanning two input files) and
+// never continue a run from the previous block. After the last block comes
+// the index, one entry per block:
+//
+//   u64              offset of the block in the uncompressed output
+//   u64              offset of the block's first record in this file
+//
+// and finally a 32-byte trailer:
+//
+//   u64              number of blocks
+//   u64              uncompressed size
+//   u64              offset of the index in this file
+//   "WZFINDEX"
+//
+// Integers are in host byte order, like the counts in records. Blocks can
+// be found (and decoded) on their own, so a byte range can be decoded
+// without the blocks before it.
+//
+#define FRAME_MAGIC "\0\0\0\0WZF1"
+#define INDEX_MAGIC "WZFINDEX"
+#define MAGIC_SIZE 8
+#define HEADER_SIZE 16
+#define TRAILER_SIZE 32
+
+//
+// Varint format, as written by wzip -v: the magic "\0\0\0\0WZV1", then
+// items that each start with a LEB128 varint h. An odd h is a run of
+// (h >> 1) + 1 copies of the byte that follows; an even one a literal
+// stretch of the (h >> 1) + 1 bytes that follow. Runs can be of any
+// length and continue across input files, as in the plain format.
+//
+#define VARINT_MAGIC "\0\0\0\0WZV1"
+// Longest varint for 64 bits.
+#define VARINT_MAX 10
+
+//
+// Output. A writer either appends to stdout, or, in parallel mode, writes
+// its own part of the output file at 'offset' with pwrite().
+//
+typedef struct Writer {
+    char *buffer;           // OUT_BUFFER bytes
+    size_t len;
+    bool positioned;
+    off_t offset;
+    bool failed;
+
+    // With -r, only output bytes [skip, skip + limit) are written; both
+    // count down as the output goes by.
+    bool ranged;
+    uint64_t skip;
+    uint64_t limit;
+} writer_t;
+
+static void write_all(writer_t *w, struct iovec *iov, int iovcnt) {
+    ssize_t n = 0;
+    while (iovcnt > 0 && !w->failed) {
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt == 0) {
+            break;
+        }
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+        if (w->positioned) {
+            n = pwritev(STDOUT_FILENO, iov, iovcnt, w->offset);
+        } else {
+            n = writev(STDOUT_FILENO, iov, iovcnt);
+        }
+        if (n <= 0) {
+            w->failed = true;
+        } else {
+            w->offset += n;
+        }
+    }
+}
+
+static void flush_output(writer_t *w) {
+    struct iovec iov = { w->buffer, w->len };
+    write_all(w, &iov, 1);
+    w->len = 0;
+}
+
+static void expand_run(writer_t *w, char c, size_t n) {
+    // A run that fills the buffer more than once is set once and the same
+    // buffer written repeatedly.
+    if (n >= 2 * OUT_BUFFER) {
+        flush_output(w);
+        memset(w->buffer, c, OUT_BUFFER);
+        struct iovec iov[REPEAT_IOVS];
+        while (n >= OUT_BUFFER) {
+            int k = 0;
+            for (; k < REPEAT_IOVS && n >= OUT_BUFFER; ++k, n -= OUT_BUFFER) {
+                iov[k].iov_base = w->buffer;
+                iov[k].iov_len = OUT_BUFFER;
+            }
+            write_all(w, iov, k);
+        }
+    }
+    while (n > 0) {
+        if (w->len == OUT_BUFFER) {
+            flush_output(w);
+        }
+        size_t k = OUT_BUFFER - w->len < n ? OUT_BUFFER - w->len : n;
+        memset(w->buffer + w->len, c, k);
+        w->len += k;
+        n -= k;
+    }
+}
+
+// With a range, trims the next 'n' bytes of output to the part inside it.
+// Returns how many were dropped from the front.
+static uint64_t clip(writer_t *w, uint64_t *n) {
+    if (!w->ranged) {
+        return 0;
+    }
+    uint64_t drop = w->skip < *n ? w->skip : *n;
+    w->skip -= drop;
+    *n -= drop;
+    *n = *n < w->limit ? *n : w->limit;
+    w->limit -= *n;
+    return drop;
+}
+
+static void copy_bytes(writer_t *w, char const *p, uint64_t n) {
+    p += clip(w, &n);
+    while (n > 0) {
+        if (w->len == OUT_BUFFER) {
+            flush_output(w);
+        }
+        size_t k = OUT_BUFFER - w->len < n ? OUT_BUFFER - w->len : n;
+        memcpy(w->buffer + w->len, p, k);
+        w->len += k;
+        p += k;
+        n -= k;
+    }
+}
+
+// Counts of zero or less expand to nothing.
+static inline int record_count(char const *record) {
+    int n;
+    memcpy(&n, record, sizeof(n));
+    return n;
+}
+
+static void expand_records_range(writer_t *w, char const *records, size_t n) {
+    for (size_t i = 0; i < n && w->limit > 0; ++i, records += RECORD_SIZE) {
+        int count = record_count(records);
+        if (count <= 0) {
+            continue;
+        }
+        if (w->skip >= (uint64_t)count) {
+            w->skip -= count;
+            continue;
+        }
+        uint64_t take = count - w->skip;
+        w->skip = 0;
+        take = take < w->limit ? take : w->limit;
+        expand_run(w, records[4], take);
+        w->limit -= take;
+    }
+}
+
+static void expand_records(writer_t *w, char const *records, size_t n) {
+    if (w->ranged) {
+        expand_records_range(w, records, n);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i, records += RECORD_SIZE) {
+        int count = record_count(records);
+        if (count <= 0) {
+            continue;
+        }
+        // Short runs are by far the most common: skip the checks.
+        if (count <= 16 && w->len + 16 <= OUT_BUFFER) {
+            memset(w->buffer + w->len, records[4], count);
+            w->len += count;
+        } else {
+            expand_run(w, records[4], count);
+        }
+    }
+}
+
+//
+// Whole inputs, for the framed format and for decoding in parallel.
+//
+typedef struct Frame {
+    char const *data;       // the whole file
+    uint64_t nblocks;
+    uint64_t size;          // uncompressed
+    uint64_t index;         // file offset of the index
+} frame_t;
+
+typedef struct Input {
+    char const *data;
+    size_t len;
+    bool mapped;            // else malloc'ed (pipes)
+    bool framed;
+    frame_t frame;
+    bool varint;
+} input_t;
 
+// Maps 'fd' if it is a regular file; reads anything else whole, after the
+// 'have' bytes already read from it into 'prefix'. Returns NULL, or what
+// went wrong.
+static char const *load_input(int fd, char const *prefix, size_t have, input_t *input) {
+    memset(input, 0, sizeof(*input));
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+        if (sbuf.st_size > 0) {
+            void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                return "cannot read file";
+            }
+            input->data = (char const *)map;
+            input->len = sbuf.st_size;
+            input->mapped = true;
+        }
+        return NULL;
+    }
+
+    size_t cap = have > OUT_BUFFER ? have : OUT_BUFFER;
+    char *data = (char *)malloc(cap);
+    if (data != NULL) {
+        memcpy(data, prefix, have);
+        input->len = have;
+    }
+    ssize_t n = 0;
+    while (data != NULL && (n = read(fd, data + input->len, cap - input->len)) > 0) {
+        input->len += n;
+        if (input->len == cap) {
+            cap *= 2;
+            data = (char *)realloc(data, cap);
+        }
+    }
+    if (data == NULL) {
+        fprintf(stderr, "wunzip: out of memory\n");
+        exit(1);
+    }
+    input->data = data;
+    return n == 0 ? NULL : "cannot read file";
+}
+
+static char const *map_input(char const *path, input_t *input) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        memset(input, 0, sizeof(*input));
+        return "cannot open file";
+    }
+    char const *error = load_input(fd, NULL, 0, input);
+    close(fd);
+    return error;
+}
+
+static void free_input(input_t *input) {
+    if (input->mapped) {
+        munmap((void *)input->data, input->len);
+    } else {
+        free((void *)input->data);
+    }
+}
+
+static bool is_framed(char const *data, size_t len) {
+    return len >= MAGIC_SIZE && memcmp(data, FRAME_MAGIC, MAGIC_SIZE) == 0;
+}
+
+static uint64_t read64(char const *p) {
+    uint64_t n;
+    memcpy(&n, p, sizeof(n));
+    return n;
+}
+
+// Where block i starts: in the output for 'field' 0, in the file for 1.
+// Block 'nblocks' stands for the end of the last one.
+static uint64_t block_at(frame_t const *f, uint64_t i, int field) {
+    if (i == f->nblocks) {
+        return field == 0 ? f->size : f->index;
+    }
+    return read64(f->data + f->index + 16 * i + 8 * field);
+}
+
+static bool parse_frame(input_t *input) {
+    frame_t *f = &input->frame;
+    if (input->len < HEADER_SIZE + TRAILER_SIZE ||
+        memcmp(input->data + input->len - MAGIC_SIZE, INDEX_MAGIC, MAGIC_SIZE) != 0) {
+        return false;
+    }
+    char const *trailer = input->data + input->len - TRAILER_SIZE;
+    f->data = input->data;
+    f->nblocks = read64(trailer);
+    f->size = read64(trailer + 8);
+    f->index = read64(trailer + 16);
+    if (f->nblocks > input->len / 16 || f->index < HEADER_SIZE ||
+        f->index + 16 * f->nblocks + TRAILER_SIZE != input->len) {
+        return false;
+    }
+
+    // Blocks must follow each other, from the header to the index, and
+    // hold whole records.
+    uint64_t raw = 0;
+    uint64_t offset = HEADER_SIZE;
+    for (uint64_t i = 0; i <= f->nblocks; ++i) {
+        uint64_t blockRaw = block_at(f, i, 0);
+        uint64_t blockOffset = block_at(f, i, 1);
+        if (blockRaw < raw || blockOffset < offset || (blockOffset - offset) % RECORD_SIZE != 0 ||
+            (i == 0 && blockOffset != HEADER_SIZE)) {
+            return false;
+        }
+        raw = blockRaw;
+        offset = blockOffset;
+    }
+    input->framed = true;
+    return true;
+}
+
+static char const *expand_framed(writer_t *w, input_t *input) {
+    if (!parse_frame(input)) {
+        return "corrupt file";
+    }
+    frame_t const *f = &input->frame;
+
+    // With a range, the blocks before it are skipped without decoding.
+    uint64_t first = 0;
+    if (w->ranged) {
+        while (first < f->nblocks && block_at(f, first + 1, 0) <= w->skip) {
+            ++first;
+        }
+        if (first == f->nblocks) {
+            w->skip -= f->size;
+            return NULL;
+        }
+        w->skip -= block_at(f, first, 0);
+    }
+    uint64_t start = block_at(f, first, 1);
+    expand_records(w, f->data + start, (f->index - start) / RECORD_SIZE);
+    return NULL;
+}
+
+//
+// Varint format. Items can be cut anywhere by the end of a buffer: a
+// literal stretch is copied as far as it goes, with the rest left in
+// '*literal' for the next buffer, and an incomplete header is left
+// unconsumed. Returns how many bytes were consumed, or -1 if a varint is
+// too long.
+//
+static ssize_t expand_varint(writer_t *w, uint64_t *literal, char const *p, size_t n) {
+    size_t i = 0;
+    for (;;) {
+        if (*literal > 0) {
+            uint64_t k = *literal < n - i ? *literal : n - i;
+            copy_bytes(w, p + i, k);
+            *literal -= k;
+            i += k;
+        }
+        if (i == n || (w->ranged && w->limit == 0)) {
+            return i;
+        }
+
+        uint64_t h = 0;
+        size_t j = i;
+        for (int shift = 0; j < n; shift += 7) {
+            if (shift >= 7 * VARINT_MAX) {
+                return -1;
+            }
+            h |= (uint64_t)(p[j] & 0x7f) << shift;
+            if ((p[j++] & 0x80) == 0) {
+                break;
+            }
+        }
+        if ((p[j - 1] & 0x80) != 0 || ((h & 1) != 0 && j == n)) {
+            return i;
+        }
+        if ((h & 1) != 0) {
+            uint64_t count = (h >> 1) + 1;
+            clip(w, &count);
+            expand_run(w, p[j], count);
+            i = j + 1;
+        } else {
+            *literal = (h >> 1) + 1;
+            i = j;
+        }
+    }
+}
+
+// Adds up the output size of a whole varint file (after the magic).
+// Returns false if a varint is too long, with '*size' set to the output
+// before it, which is what expand_varint() writes.
+static bool varint_size(char const *p, size_t n, uint64_t *size) {
+    *size = 0;
+    size_t i = 0;
+    while (i < n) {
+        uint64_t h = 0;
+        for (int shift = 0; i < n; shift += 7) {
+            if (shift >= 7 * VARINT_MAX) {
+                return false;
+            }
+            h |= (uint64_t)(p[i] & 0x7f) << shift;
+            if ((p[i++] & 0x80) == 0) {
+                break;
+            }
+        }
+        uint64_t length = (h >> 1) + 1;
+        if ((h & 1) != 0) {
+            *size += i < n ? length : 0;
+            i += 1;
+        } else {
+            length = length < n - i ? length : n - i;
+            *size += length;
+            i += length;
+        }
+    }
+    return true;
+}
+
+//
+// Streaming: one file at a time, in blocks. A record cut in two by a read
+// is completed by the next one; a partial record at the end of a file is
+// ignored, as is a partial item at the end of a varint file. Framed files
+// are loaded whole instead, to get at their index.
+//
+static char const *expand_file(writer_t *w, int fd) {
+    static char input[READ_RECORDS * RECORD_SIZE];
+    size_t have = 0;
+    ssize_t n = 1;
+    while (have < MAGIC_SIZE && (n = read(fd, input + have, sizeof(input) - have)) > 0) {
+        have += n;
+    }
+    if (is_framed(input, have)) {
+        input_t whole;
+        char const *error = load_input(fd, input, have, &whole);
+        if (error == NULL) {
+            error = expand_framed(w, &whole);
+        }
+        free_input(&whole);
+        return error;
+    }
+    if (have >= MAGIC_SIZE && memcmp(input, VARINT_MAGIC, MAGIC_SIZE) == 0) {
+        uint64_t literal = 0;
+        have -= MAGIC_SIZE;
+        memmove(input, input + MAGIC_SIZE, have);
+        for (;;) {
+            ssize_t used = expand_varint(w, &literal, input, have);
+            if (used < 0) {
+                return "corrupt file";
+            }
+            memmove(input, input + used, have - used);
+            have -= used;
+            if (n <= 0 || (w->ranged && w->limit == 0)) {
+                break;
+            }
+            n = read(fd, input + have, sizeof(input) - have);
+            have += n > 0 ? n : 0;
+        }
+        return n >= 0 ? NULL : "cannot read file";
+    }
+
+    for (;;) {
+        size_t records = have / RECORD_SIZE;
+        expand_records(w, input, records);
+        memmove(input, input + records * RECORD_SIZE, have % RECORD_SIZE);
+        have %= RECORD_SIZE;
+        if (n <= 0 || (w->ranged && w->limit == 0)) {
+            break;
+        }
+        n = read(fd, input + have, sizeof(input) - have);
+        have += n > 0 ? n : 0;
+    }
+    return n >= 0 ? NULL : "cannot read file";
+}
+
+//
+// Parallel: all of the input is mapped and cut on record boundaries into
+// pieces; the blocks of framed files are pieces already, and varint files
+// (which can't be cut without decoding them) are one piece each. Workers first add
+// up each piece's output size (the index has it for blocks); a prefix sum
+// over those gives every piece its offset in the output file, and the
+// workers then expand the pieces and pwrite() them there, in any order.
+//
+typedef struct Piece {
+    char const *records;
+    size_t n;
+    bool varint;            // a whole varint file of n bytes, instead
+    bool corrupt;           // a varint that is too long ends it
+    bool sized;             // 'size' known up front
+    uint64_t size;          // expanded bytes
+    off_t offset;           // where they go in the output file
+} piece_t;
+
+typedef struct Job {
+    piece_t *pieces;
+    size_t npieces;
+    size_t next;            // next piece to hand out, taken atomically
+    bool write;             // second pass
+    bool failed;
+    bool corrupt;
+} job_t;
+
+static void *worker(void *arg) {
+    job_t *job = (job_t *)arg;
+    writer_t w = { NULL, 0, true, 0, false, false, 0, 0 };
+    if (job->write) {
+        w.buffer = (char *)malloc(OUT_BUFFER);
+    }
+
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->npieces) {
+        piece_t *piece = &job->pieces[i];
+        if (!job->write) {
+            if (piece->sized) {
+                continue;
+            }
+            if (piece->varint) {
+                piece->corrupt = !varint_size(piece->records, piece->n, &piece->size);
+                continue;
+            }
+            uint64_t size = 0;
+            char const *record = piece->records;
+            for (size_t k = 0; k < piece->n; ++k, record += RECORD_SIZE) {
+                int count = record_count(record);
+                size += count > 0 ? count : 0;
+            }
+            piece->size = size;
+        } else {
+            w.offset = piece->offset;
+            if (piece->varint) {
+                uint64_t literal = 0;
+                if (expand_varint(&w, &literal, piece->records, piece->n) < 0) {
+                    __atomic_store_n(&job->corrupt, true, __ATOMIC_RELAXED);
+                }
+            } else {
+                expand_records(&w, piece->records, piece->n);
+            }
+            flush_output(&w);
+        }
+    }
+
+    if (w.failed) {
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+    }
+    free(w.buffer);
+    return NULL;
+}
+
+static void run_workers(job_t *job, size_t nthreads) {
+    pthread_t *threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    job->next = 0;
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_create(&threads[i], NULL, worker, job);
+    }
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Decodes the files into stdout, which must be a regular file opened
+// without O_APPEND. Stops at the first file that can't be read, after
+// writing everything before it, like the streaming decoder.
+static int expand_parallel(int nfiles, char *files[], size_t nthreads) {
+    input_t *inputs = (input_t *)calloc(nfiles + 1, sizeof(input_t));
+    int ninputs = 0;
+    char const *error = NULL;
+    size_t total = 0;
+    size_t blocks = 0;
+    for (int i = 0; i < nfiles; ++i) {
+        input_t *input = &inputs[ninputs];
+        error = map_input(files[i], input);
+        if (error == NULL && is_framed(input->data, input->len) && !parse_frame(input)) {
+            error = "corrupt file";
+        }
+        if (error != NULL) {
+            free_input(input);
+            break;
+        }
+        if (input->framed) {
+            blocks += input->frame.nblocks;
+        } else if (input->len >= MAGIC_SIZE && memcmp(input->data, VARINT_MAGIC, MAGIC_SIZE) == 0) {
+            input->varint = true;
+        } else {
+            total += input->len / RECORD_SIZE;
+        }
+        ++ninputs;
+    }
+
+    // A few pieces per thread, so that threads finishing early can help.
+    size_t pieceRecords = total / (nthreads * 4) + 1;
+    if (pieceRecords > PIECE_RECORDS) {
+        pieceRecords = PIECE_RECORDS;
+    }
+    job_t job;
+    memset(&job, 0, sizeof(job));
+    job.pieces = (piece_t *)calloc(total / pieceRecords + ninputs + blocks + 1, sizeof(piece_t));
+    for (int i = 0; i < ninputs; ++i) {
+        frame_t const *f = &inputs[i].frame;
+        for (uint64_t k = 0; inputs[i].framed && k < f->nblocks; ++k) {
+            piece_t *piece = &job.pieces[job.npieces++];
+            piece->records = f->data + block_at(f, k, 1);
+            piece->n = (block_at(f, k + 1, 1) - block_at(f, k, 1)) / RECORD_SIZE;
+            piece->sized = true;
+            piece->size = block_at(f, k + 1, 0) - block_at(f, k, 0);
+        }
+        if (inputs[i].varint) {
+            piece_t *piece = &job.pieces[job.npieces++];
+            piece->records = inputs[i].data + MAGIC_SIZE;
+            piece->n = inputs[i].len - MAGIC_SIZE;
+            piece->varint = true;
+        }
+        size_t records = inputs[i].framed || inputs[i].varint ? 0 : inputs[i].len / RECORD_SIZE;
+        for (size_t k = 0; k < records; k += pieceRecords) {
+            piece_t *piece = &job.pieces[job.npieces++];
+            piece->records = inputs[i].data + k * RECORD_SIZE;
+            piece->n = records - k < pieceRecords ? records - k : pieceRecords;
+        }
+    }
+
+    run_workers(&job, nthreads);
+    // Like the streaming decoder, stop after the output that comes before
+    // a corrupt varint file goes out.
+    for (size_t i = 0; i < job.npieces; ++i) {
+        if (job.pieces[i].corrupt) {
+            job.npieces = i + 1;
+            error = "corrupt file";
+            break;
+        }
+    }
+    off_t offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    for (size_t i = 0; i < job.npieces; ++i) {
+        job.pieces[i].offset = offset;
+        offset += job.pieces[i].size;
+    }
+    job.write = true;
+    run_workers(&job, nthreads);
+    // Leave stdout where a sequential writer would have.
+    lseek(STDOUT_FILENO, offset, SEEK_SET);
+
+    for (int i = 0; i < ninputs; ++i) {
+        free_input(&inputs[i]);
+    }
+    free(inputs);
+    free(job.pieces);
+
+    if (error == NULL && job.corrupt) {
+        error = "corrupt file";
+    }
+    if (error != NULL) {
+        printf("wunzip: %s\n", error);
+        return 1;
+    }
+    return job.failed ? 1 : 0;
+}
+
+// How many threads to decode with: WUNZIP_THREADS if set, otherwise one
+// per CPU for inputs big enough to be worth it. Only regular files can be
+// written at arbitrary offsets, so anything else gets 1.
+static size_t choose_threads(int nfiles, char *files[]) {
+    struct stat sbuf;
+    if (fstat(STDOUT_FILENO, &sbuf) != 0 || !S_ISREG(sbuf.st_mode) ||
+        (fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND) != 0) {
+        return 1;
+    }
+    char const *value = getenv("WUNZIP_THREADS");
+    if (value != NULL && atol(value) > 0) {
+        return atol(value);
+    }
+
+    off_t total = 0;
+    for (int i = 0; i < nfiles; ++i) {
+        if (stat(files[i], &sbuf) == 0) {
+            total += sbuf.st_size;
+        }
+    }
+    return total >= PARALLEL_MIN ? get_nprocs() : 1;
+}
+
+// Parses -r's start:end (end excluded; either may be left out).
+static bool parse_range(char const *arg, writer_t *w) {
+    char *end;
+    w->ranged = true;
+    w->skip = strtoull(arg, &end, 10);
+    if (*end != ':') {
+        return false;
+    }
+    if (end[1] == '\0') {
+        w->limit = UINT64_MAX;
+        return true;
+    }
+    uint64_t last = strtoull(end + 1, &end, 10);
+    w->limit = last - w->skip;
+    return *end == '\0' && last >= w->skip;
+}
+
+// wunzip [-r start:end] file1 [file2 ...]: -r writes only bytes [start,
+// end) of the output, decoding only the blocks it needs in framed files.
 int main(int argc, char *argv[]) {
-    if (argc == 1) {
+    static char buffer[OUT_BUFFER];
+    writer_t writer = { buffer, 0, false, 0, false, false, 0, 0 };
+    int opt;
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt != 'r' || !parse_range(optarg, &writer)) {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind == argc) {
         printf("wunzip: file1 [file2 ...]\n");
         return 1;
     }
+    int nfiles = argc - optind;
+    char **files = argv + optind;
 
-    char buffer[5];
-    for (int i = 1; i < argc; ++i) {
-        FILE *f = fopen(argv[i], "r");
-        if (f == NULL) {
+    size_t nthreads = writer.ranged ? 1 : choose_threads(nfiles, files);
+    if (nthreads > 1) {
+        return expand_parallel(nfiles, files, nthreads);
+    }
+
+    for (int i = 0; i < nfiles && !(writer.ranged && writer.limit == 0); ++i) {
+        int fd = open(files[i], O_RDONLY);
+        if (fd < 0) {
+            // Whatever was expanded so far still goes out first.
+            flush_output(&writer);
             printf("wunzip: cannot open file\n");
             return 1;
         }
-        
-        size_t buffer_size = 0;
-        while ((buffer_size = fread(buffer, sizeof(char), 5, f)) > 0) {
-            int n = *((int *)buffer);
-            char c = buffer[4];
-            for (int j = 0; j < n; ++j) {
-                printf("%c", c);
-            }
+        char const *error = expand_file(&writer, fd);
+        close(fd);
+        if (error != NULL) {
+            flush_output(&writer);
+            printf("wunzip: %s\n", error);
+            return 1;
         }
     }
-    return 0;
-}
\ No newline at end of file
+    flush_output(&writer);
+
+    return writer.failed ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+#! /bin/bash
+
+# Usage: ./bench-wzip.sh [megabytes] [wzip binary ...]
+#
+# Generates random, short-run and long-run inputs with tests/filegen.py
+# (64 MB each by default), runs each wzip binary over them a few times and
+# prints the best throughput in GB/s of input. Set KERNELS (e.g.
+# KERNELS="scalar sse2 avx2") to run each binary once per run-scanning
+# kernel, and FLAGS (e.g. FLAGS=-v) to pass options to wzip.
+
+size=${1:-64}
+shift
+bins=${*:-./wzip}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+for kind in random runs repeat; do
+    python3 tests/filegen.py $kind $size > $dir/$kind.in
+done
+
+# bench binary kernel kind
+bench () {
+    local bytes=$(stat -c %s $dir/$3.in)
+    local best=
+    for run in 1 2 3; do
+        local start=$(date +%s.%N)
+        WZIP_KERNEL=$2 $1 $FLAGS $dir/$3.in > $dir/out
+        local end=$(date +%s.%N)
+        best=$(awk -v s=$start -v e=$end -v b="$best" 'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+    done
+    local out=$(stat -c %s $dir/out)
+    printf "%-12s %-7s %-7s %6d MB -> %6d MB  %7.3f s  %6.2f GB/s\n" $1 ${2:-default} $3 \
+           $((bytes >> 20)) $((out >> 20)) $best $(awk -v n=$bytes -v t=$best 'BEGIN { print n / t / 1e9 }')
+}
+
+for bin in $bins; do
+    if ! [[ -x $bin ]]; then
+        echo "$bin executable does not exist"
+        exit 1
+    fi
+    for kernel in ${KERNELS:-""}; do
+        for kind in random runs repeat; do
+            bench $bin "$kernel" $kind
+        done
+    done
+done
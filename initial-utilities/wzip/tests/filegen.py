@@ -1,15 +1,55 @@
 #! /usr/bin/env python3
 
+# Usage: filegen.py [runs|random|repeat] [megabytes]
+#
+# runs    short runs (1-20) of random letters and newlines; this is the
+#         default and, without a size, what test 6 was generated with
+# random  every byte picked independently, the worst case for wzip
+# repeat  long runs (thousands of bytes) of the same letter
+
 import random
 import string
+import sys
 
-for i in range(1000000):
-    x = ''
-    letter = random.choice(string.ascii_lowercase + '\n')
-    if letter == '\n':
-        x += letter
-    else:
-        for i in range(int(random.random() * 20) + 1):
+kind = sys.argv[1] if len(sys.argv) > 1 else 'runs'
+size = int(float(sys.argv[2]) * 1024 * 1024) if len(sys.argv) > 2 else None
+alphabet = string.ascii_lowercase + '\n'
+out = sys.stdout.buffer
+
+if kind == 'runs' and size is None:
+    for i in range(1000000):
+        x = ''
+        letter = random.choice(string.ascii_lowercase + '\n')
+        if letter == '\n':
             x += letter
-    print(x, end='')
+        else:
+            for i in range(int(random.random() * 20) + 1):
+                x += letter
+        print(x, end='')
+    sys.exit(0)
 
+if kind not in ('runs', 'random', 'repeat'):
+    sys.exit('usage: filegen.py [runs|random|repeat] [megabytes]')
+if size is None:
+    size = 64 * 1024 * 1024
+
+# For 'random': maps random bytes onto the alphabet (close enough to
+# uniform).
+table = bytes(ord(alphabet[i % len(alphabet)]) for i in range(256))
+
+written = 0
+while written < size:
+    if kind == 'random':
+        block = random.randbytes(min(1 << 20, size - written)).translate(table).decode()
+    else:
+        longest = 20 if kind == 'runs' else 100000
+        parts = []
+        length = 0
+        while length < (1 << 20):
+            letter = random.choice(alphabet)
+            count = 1 if letter == '\n' else random.randint(1, longest)
+            parts.append(letter * count)
+            length += count
+        block = ''.join(parts)[:size - written]
+    out.write(block.encode())
+    written += len(block)
@@ -1,46 +1,498 @@
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define N 256
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
+// Input that can't be mapped (pipes, empty files) is read this much at a
+// time.
+#define READ_CHUNK (1024 * 1024)
+// Records are collected here and handed to write() in one go.
+#define OUT_BUFFER (1024 * 1024)
+#define RECORD_SIZE 5
+
+// The framed format (-b) is described in wunzip.c.
+#define FRAME_MAGIC "\0\0\0\0WZF1"
+#define INDEX_MAGIC "WZFINDEX"
+#define MAGIC_SIZE 8
+
+// The varint format (-v), also described in wunzip.c, starts with this
+// magic; runs shorter than VARINT_MIN_RUN go into literal stretches of at
+// most LITERAL_MAX bytes.
+#define VARINT_MAGIC "\0\0\0\0WZV1"
+#define VARINT_MIN_RUN 3
+#define LITERAL_MAX 4096
+
+typedef struct Encoder {
+    char out[OUT_BUFFER];
+    size_t out_len;
+    char c;                 // byte of the current run
+    uint64_t count;         // length of the current run so far, 0 if none
+    bool failed;
+    uint64_t written;       // bytes handed to write() so far
+
+    // Framed format only; block_size is 0 for the plain one.
+    uint64_t block_size;
+    uint64_t block_used;    // input bytes in the current block
+    uint64_t raw;           // input bytes in finished blocks
+    uint64_t *index;        // per block: input offset, then output offset
+    size_t nblocks;
+    size_t index_cap;
+
+    // Varint format only.
+    bool varint;
+    char literal[LITERAL_MAX];
+    size_t literal_len;
+} encoder_t;
+
+static encoder_t encoder;
+
+//
+// Finding where a run ends. Each kernel returns the first byte in [p, end)
+// that differs from 'c', or 'end'. The vector ones compare 16 or 32 bytes
+// against a broadcast of 'c' per step and count the equal bytes in the
+// mask, but first check a single byte so that short runs don't pay for
+// the setup.
+//
+typedef char const *(*run_end_fn)(char const *p, char const *end, char c);
+
+static char const *run_end_scalar(char const *p, char const *end, char c) {
+    while (p < end && *p == c) {
+        ++p;
+    }
+    return p;
+}
+
+#if defined(__x86_64__)
+static char const *run_end_sse2(char const *p, char const *end, char c) {
+    if (p == end || *p != c) {
+        return p;
+    }
+    __m128i needle = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((__m128i const *)p);
+        unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)) & 0xffff;
+        if (differ != 0) {
+            return p + __builtin_ctz(differ);
+        }
+        p += 16;
+    }
+    return run_end_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static char const *run_end_avx2(char const *p, char const *end, char c) {
+    if (p == end || *p != c) {
+        return p;
+    }
+    __m256i needle = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((__m256i const *)p);
+        unsigned differ = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (differ != 0) {
+            return p + __builtin_ctz(differ);
+        }
+        p += 32;
+    }
+    return run_end_sse2(p, end, c);
+}
+#endif
+
+//
+// Finding where a run starts, for the varint format, which copies the
+// bytes in between as they are. Each kernel returns the first x in
+// [p, end - 1) with x[0] == x[1], or NULL; the vector ones compare a block
+// with itself shifted by one byte.
+//
+typedef char const *(*pair_start_fn)(char const *p, char const *end);
+
+static char const *pair_start_scalar(char const *p, char const *end) {
+    for (; p + 1 < end; ++p) {
+        if (p[0] == p[1]) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+static char const *pair_start_sse2(char const *p, char const *end) {
+    while (end - p > 16) {
+        __m128i a = _mm_loadu_si128((__m128i const *)p);
+        __m128i b = _mm_loadu_si128((__m128i const *)(p + 1));
+        unsigned equal = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        if (equal != 0) {
+            return p + __builtin_ctz(equal);
+        }
+        p += 16;
+    }
+    return pair_start_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static char const *pair_start_avx2(char const *p, char const *end) {
+    while (end - p > 32) {
+        __m256i a = _mm256_loadu_si256((__m256i const *)p);
+        __m256i b = _mm256_loadu_si256((__m256i const *)(p + 1));
+        unsigned equal = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (equal != 0) {
+            return p + __builtin_ctz(equal);
+        }
+        p += 32;
+    }
+    return pair_start_sse2(p, end);
+}
+#endif
+
+// Picked once at startup: the widest kernels the CPU supports, unless
+// WZIP_KERNEL names others (scalar, sse2, avx2), which is how the tests
+// compare them.
+static run_end_fn run_end = run_end_scalar;
+static pair_start_fn pair_start = pair_start_scalar;
+
+static void choose_kernel() {
+    char const *name = getenv("WZIP_KERNEL");
+    name = name != NULL ? name : "";
+    if (strcmp(name, "scalar") == 0) {
+        return;
+    }
+#if defined(__x86_64__)
+    if (strcmp(name, "sse2") == 0 || !__builtin_cpu_supports("avx2")) {
+        run_end = run_end_sse2;
+        pair_start = pair_start_sse2;
+    } else {
+        run_end = run_end_avx2;
+        pair_start = pair_start_avx2;
+    }
+#endif
+}
+
+static void flush_output(encoder_t *enc) {
+    size_t done = 0;
+    while (done < enc->out_len) {
+        ssize_t n = write(STDOUT_FILENO, enc->out + done, enc->out_len - done);
+        if (n <= 0) {
+            enc->failed = true;
+            break;
+        }
+        done += n;
+    }
+    enc->written += done;
+    enc->out_len = 0;
+}
+
+static void emit_bytes(encoder_t *enc, void const *data, size_t n) {
+    if (enc->out_len + n > OUT_BUFFER) {
+        flush_output(enc);
+    }
+    memcpy(enc->out + enc->out_len, data, n);
+    enc->out_len += n;
+}
+
+static void emit_record(encoder_t *enc, int count, char c) {
+    if (enc->out_len + RECORD_SIZE > OUT_BUFFER) {
+        flush_output(enc);
+    }
+    memcpy(enc->out + enc->out_len, &count, sizeof(count));
+    enc->out[enc->out_len + 4] = c;
+    enc->out_len += RECORD_SIZE;
+}
+
+//
+// Varint format: a run of three or more bytes is the varint (count - 1) * 2
+// + 1 and the byte; shorter runs are gathered into literal stretches,
+// written as the varint (length - 1) * 2 and the bytes themselves.
+//
+static void emit_varint(encoder_t *enc, uint64_t n) {
+    char bytes[10];
+    size_t len = 0;
+    while (n >= 0x80) {
+        bytes[len++] = (char)(n | 0x80);
+        n >>= 7;
+    }
+    bytes[len++] = (char)n;
+    emit_bytes(enc, bytes, len);
+}
+
+static void flush_literals(encoder_t *enc) {
+    if (enc->literal_len > 0) {
+        emit_varint(enc, (enc->literal_len - 1) << 1);
+        emit_bytes(enc, enc->literal, enc->literal_len);
+        enc->literal_len = 0;
+    }
+}
+
+static void emit_literals(encoder_t *enc, char const *p, size_t n) {
+    while (n > 0) {
+        if (enc->literal_len == LITERAL_MAX) {
+            flush_literals(enc);
+        }
+        size_t k = LITERAL_MAX - enc->literal_len < n ? LITERAL_MAX - enc->literal_len : n;
+        memcpy(enc->literal + enc->literal_len, p, k);
+        enc->literal_len += k;
+        p += k;
+        n -= k;
+    }
+}
+
+static void emit_varint_run(encoder_t *enc, char c, uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (count < VARINT_MIN_RUN) {
+        if (enc->literal_len + count > LITERAL_MAX) {
+            flush_literals(enc);
+        }
+        memset(enc->literal + enc->literal_len, c, count);
+        enc->literal_len += count;
+        return;
+    }
+    flush_literals(enc);
+    emit_varint(enc, ((count - 1) << 1) | 1);
+    emit_bytes(enc, &c, 1);
+}
+
+// A count only holds INT_MAX, so longer runs become several records,
+// which wunzip expands back to the same bytes.
+static void emit_run(encoder_t *enc, char c, uint64_t count) {
+    if (enc->varint) {
+        emit_varint_run(enc, c, count);
+        return;
+    }
+    while (count > INT_MAX) {
+        emit_record(enc, INT_MAX, c);
+        count -= INT_MAX;
+    }
+    if (count > 0) {
+        emit_record(enc, (int)count, c);
+    }
+}
+
+// Runs continue across calls, so buffers (and files) can split a run
+// anywhere. The current run is kept in locals: stores into the output
+// buffer would otherwise force it to be reloaded from memory every byte.
+static void encode(encoder_t *enc, char const *p, size_t n) {
+    char const *end = p + n;
+    char c = enc->c;
+    uint64_t count = enc->count;
+
+    while (p < end) {
+        // Most runs in text are a single byte: skip the call for those.
+        char const *q = p + 1;
+        if (q < end && *q == *p) {
+            q = run_end(q, end, *p);
+        }
+        if (count > 0 && *p == c) {
+            count += q - p;
+        } else {
+            emit_run(enc, c, count);
+            c = *p;
+            count = q - p;
+        }
+        p = q;
+    }
+
+    enc->c = c;
+    enc->count = count;
+}
+
+//
+// Framed format: each file is cut into blocks of block_size bytes (the
+// last one shorter), each compressed on its own so that runs never cross a
+// block boundary. pzip -b cuts them the same way.
+//
+static void start_block(encoder_t *enc) {
+    if (enc->nblocks == enc->index_cap) {
+        enc->index_cap = enc->index_cap > 0 ? 2 * enc->index_cap : 1024;
+        enc->index = (uint64_t *)realloc(enc->index, 2 * enc->index_cap * sizeof(uint64_t));
+        if (enc->index == NULL) {
+            printf("wzip: out of memory\n");
+            exit(1);
+        }
+    }
+    enc->index[2 * enc->nblocks] = enc->raw;
+    enc->index[2 * enc->nblocks + 1] = enc->written + enc->out_len;
+    enc->nblocks++;
+}
+
+static void end_block(encoder_t *enc) {
+    emit_run(enc, enc->c, enc->count);
+    enc->count = 0;
+    enc->raw += enc->block_used;
+    enc->block_used = 0;
+}
+
+static void encode_framed(encoder_t *enc, char const *p, size_t n) {
+    while (n > 0) {
+        if (enc->block_used == 0) {
+            start_block(enc);
+        }
+        size_t take = enc->block_size - enc->block_used < n ? enc->block_size - enc->block_used : n;
+        encode(enc, p, take);
+        enc->block_used += take;
+        p += take;
+        n -= take;
+        if (enc->block_used == enc->block_size) {
+            end_block(enc);
+        }
+    }
+}
+
+static void write_header(encoder_t *enc) {
+    uint32_t header[2] = { enc->block_size > UINT32_MAX ? 0 : (uint32_t)enc->block_size, 0 };
+    emit_bytes(enc, FRAME_MAGIC, MAGIC_SIZE);
+    emit_bytes(enc, header, sizeof(header));
+}
+
+static void write_index(encoder_t *enc) {
+    uint64_t trailer[3] = { enc->nblocks, enc->raw, enc->written + enc->out_len };
+    for (size_t i = 0; i < enc->nblocks; ++i) {
+        emit_bytes(enc, &enc->index[2 * i], 2 * sizeof(uint64_t));
+    }
+    emit_bytes(enc, trailer, sizeof(trailer));
+    emit_bytes(enc, INDEX_MAGIC, MAGIC_SIZE);
+}
+
+// Like encode(), but bytes that aren't part of a run are copied in bulk
+// rather than looked at one run at a time. The last run of the buffer is
+// kept pending, since the next one may continue it.
+static void encode_varint(encoder_t *enc, char const *p, size_t n) {
+    char const *end = p + n;
+    if (enc->count > 0) {
+        char const *q = run_end(p, end, enc->c);
+        enc->count += q - p;
+        p = q;
+        if (p == end) {
+            return;
+        }
+        emit_varint_run(enc, enc->c, enc->count);
+        enc->count = 0;
+    }
+
+    while (p < end) {
+        // Runs often follow each other directly: skip the call for those.
+        char const *start = p + 1 < end && p[0] == p[1] ? p : pair_start(p, end);
+        if (start == NULL) {
+            emit_literals(enc, p, end - 1 - p);
+            enc->c = end[-1];
+            enc->count = 1;
+            return;
+        }
+        emit_literals(enc, p, start - p);
+        char const *q = run_end(start + 2, end, *start);
+        if (q == end) {
+            enc->c = *start;
+            enc->count = q - start;
+            return;
+        }
+        emit_varint_run(enc, *start, q - start);
+        p = q;
+    }
+}
+
+static void consume(encoder_t *enc, char const *p, size_t n) {
+    if (enc->varint) {
+        encode_varint(enc, p, n);
+    } else if (enc->block_size > 0) {
+        encode_framed(enc, p, n);
+    } else {
+        encode(enc, p, n);
+    }
+}
+
+static bool encode_file(encoder_t *enc, int fd) {
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && sbuf.st_size > 0) {
+        void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, sbuf.st_size, MADV_SEQUENTIAL);
+            consume(enc, (char const *)map, sbuf.st_size);
+            munmap(map, sbuf.st_size);
+            return true;
+        }
+    }
+
+    static char buffer[READ_CHUNK];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        consume(enc, buffer, n);
+    }
+    return n == 0;
+}
+
+// Sizes like 65536, 64k or 1m.
+static uint64_t parse_size(char const *arg) {
+    char *end;
+    uint64_t n = strtoull(arg, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        n <<= 10;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        n <<= 20;
+        ++end;
+    }
+    return *end == '\0' ? n : 0;
+}
+
+// wzip [-b blocksize | -v] file1 [file2 ...]: -b writes the framed format
+// with blocks of that many input bytes instead of the plain one, -v the
+// varint format.
 int main(int argc, char *argv[]) {
-    if (argc == 1) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:v")) != -1) {
+        if (opt == 'v') {
+            encoder.varint = true;
+        } else if (opt != 'b' || (encoder.block_size = parse_size(optarg)) == 0) {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind == argc || (encoder.varint && encoder.block_size > 0)) {
         printf("wzip: file1 [file2 ...]\n");
         return 1;
     }
+    choose_kernel();
 
-    char buffer[N];
-    bool first_char = true;
-    char c = 0;
-    int c_counter = 0;
-    size_t buffer_size = 0;
-    char result[5];
-
-    for (int i = 1; i < argc; ++i) {
-        FILE *f = fopen(argv[i], "r");
-        if (f == NULL) {
+    if (encoder.block_size > 0) {
+        write_header(&encoder);
+    } else if (encoder.varint) {
+        emit_bytes(&encoder, VARINT_MAGIC, MAGIC_SIZE);
+    }
+    for (int i = optind; i < argc; ++i) {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd < 0) {
+            // Whatever was compressed so far still goes out first.
+            flush_output(&encoder);
             printf("wzip: cannot open file\n");
             return 1;
         }
-        while ((buffer_size = fread(buffer, sizeof(char), N, f)) > 0) {
-            for (int j = 0; j < buffer_size; ++j) {
-                if (c != buffer[j] && !first_char) {
-                    *((int *)result) = c_counter;
-                    result[4] = c;
-                    fwrite(result, sizeof(char), 5, stdout);
-                    c_counter = 0;
-                }
-                first_char = false;
-                c = buffer[j];
-                ++c_counter;
-            }
+        bool ok = encode_file(&encoder, fd);
+        close(fd);
+        if (encoder.block_used > 0) {
+            end_block(&encoder);
+        }
+        if (!ok) {
+            flush_output(&encoder);
+            printf("wzip: cannot read file\n");
+            return 1;
         }
     }
-    if (c_counter != 0) {
-        *((int *)result) = c_counter;
-        result[4] = c;
-        fwrite(result, sizeof(char), 5, stdout);
+    if (encoder.block_size > 0) {
+        write_index(&encoder);
+    } else {
+        emit_run(&encoder, encoder.c, encoder.count);
+        flush_literals(&encoder);
     }
+    flush_output(&encoder);
 
-    return 0;
-}
\ No newline at end of file
+    return encoder.failed ? 1 : 0;
+}